@@ -7,6 +7,8 @@ static const int CONFIG_FD = 64;
 static const int RAM_FD = 65;
 static const int KERNEL_FD = 66;
 static const int BLOCK_FD = 67;
+static const int DELTA_FD = 68;
+static const int IMAGE_FD = 69;
 
 static const size_t RAM_START = 0x80000000;
 static const size_t RAM_SIZE = 16ul << 20;
@@ -14,10 +16,59 @@ static const size_t SIGSTACK_SIZE = 4096;
 
 static const size_t KERNEL_START = 0x80200000;
 
+// Tunables, set from the loader command line
+struct urvirt_options {
+    size_t fault_around;    // Pages to map around a page fault, 1 to map just the one
+    size_t eager_leaves;    // Build shadow page tables on satp writes for address
+                            // spaces with up to this many leaves, 0 to never
+    size_t vma_budget;      // Host VMAs to use at most, roughly
+    int ecall_mode;         // How guest ecalls are made to trap, ECALL_*
+    size_t interp_hot;      // Traps at a pc before code there is interpreted,
+                            // 0 to never
+    size_t patch_after;     // Traps at a CSR instruction before it's patched,
+                            // 0 to never
+    int block_copy;         // How block transfers move data, BLOCK_COPY_*
+    int overlay;            // BLOCK_FD is a read-only base image and writes go
+                            // to DELTA_FD, see urvirt-overlay.h
+    int ramdisk;            // What happens to a disk image loaded into memory,
+                            // RAMDISK_*
+};
+
+// Use syscall user dispatch if the host has it, otherwise a Seccomp filter
+static const int ECALL_AUTO = 0;
+static const int ECALL_SECCOMP = 1;
+static const int ECALL_DISPATCH = 2;
+
+// Block transfers into one buffer use copy_file_range between BLOCK_FD and
+// RAM_FD if the host allows it between the two, and preadv and pwritev on the
+// RAM window otherwise
+static const int BLOCK_COPY_AUTO = 0;
+static const int BLOCK_COPY_RANGE = 1;
+static const int BLOCK_COPY_PREADV = 2;
+
+// With a RAM disk, BLOCK_FD is a memfd the loader read the disk image into.
+// Writes to it are thrown away on exit, or written back to the image, which is
+// IMAGE_FD then, when the guest shuts down.
+static const int RAMDISK_OFF = 0;
+static const int RAMDISK_DISCARD = 1;
+static const int RAMDISK_WRITEBACK = 2;
+
+static const size_t DEFAULT_FAULT_AROUND = 16;
+
+static const size_t DEFAULT_INTERP_HOT = 16;
+
+// Patching writes to guest RAM the guest didn't give us, see patch.h, so it's
+// off unless asked for
+static const size_t DEFAULT_PATCH_AFTER = 0;
+
+// vm.max_map_count is 65530 by default
+static const size_t DEFAULT_VMA_BUDGET = 32768;
+
 struct urvirt_config {
     void *stub_start;   // Start address of the stub
     size_t stub_size;   // Number of bytes the stub takes up
     size_t kernel_size; // Number of bytes of the kernel file
+    struct urvirt_options opts;
 };
 
 static const size_t CONF_SIZE = 4096;
@@ -21,10 +21,35 @@ ins_bitfield(csr, 20, 12)
 
 #undef ins_bitfield
 
-static const uint32_t OPCODE_SYSTEM = 0b1110011;
-static const uint32_t OPCODE_LOAD   = 0b0000011;
-static const uint32_t OPCODE_STORE  = 0b0100011;
-static const uint32_t OPCODE_AMO    = 0b0101111;
+static const uint32_t OPCODE_SYSTEM    = 0b1110011;
+static const uint32_t OPCODE_LOAD      = 0b0000011;
+static const uint32_t OPCODE_STORE     = 0b0100011;
+static const uint32_t OPCODE_AMO       = 0b0101111;
+static const uint32_t OPCODE_OP_IMM    = 0b0010011;
+static const uint32_t OPCODE_OP_IMM_32 = 0b0011011;
+static const uint32_t OPCODE_OP        = 0b0110011;
+static const uint32_t OPCODE_OP_32     = 0b0111011;
+static const uint32_t OPCODE_LUI       = 0b0110111;
+static const uint32_t OPCODE_AUIPC     = 0b0010111;
+static const uint32_t OPCODE_BRANCH    = 0b1100011;
+static const uint32_t OPCODE_JAL       = 0b1101111;
+static const uint32_t OPCODE_JALR      = 0b1100111;
+static const uint32_t OPCODE_MISC_MEM  = 0b0001111;
+static const uint32_t OPCODE_LOAD_FP   = 0b0000111;
+static const uint32_t OPCODE_STORE_FP  = 0b0100111;
+
+// funct5 of A extension instructions
+static const uint32_t AMO_ADD   = 0b00000;
+static const uint32_t AMO_SWAP  = 0b00001;
+static const uint32_t AMO_LR    = 0b00010;
+static const uint32_t AMO_SC    = 0b00011;
+static const uint32_t AMO_XOR   = 0b00100;
+static const uint32_t AMO_OR    = 0b01000;
+static const uint32_t AMO_AND   = 0b01100;
+static const uint32_t AMO_MIN   = 0b10000;
+static const uint32_t AMO_MAX   = 0b10100;
+static const uint32_t AMO_MINU  = 0b11000;
+static const uint32_t AMO_MAXU  = 0b11100;
 
 static const uint32_t FUNCT7_WFI = 0b001000;
 static const uint32_t RS2_WFI = 0b00101;
@@ -43,6 +68,35 @@ static const uint32_t CSR_OP_RW     = 0b001;
 static const uint32_t CSR_OP_RS     = 0b010;
 static const uint32_t CSR_OP_RC     = 0b011;
 
+// Encoding instructions
+
+static inline uint32_t enc_i(uint32_t opcode, uint32_t rd, uint32_t funct3, uint32_t rs1, int64_t imm) {
+    return ((imm & 0xfff) << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | opcode;
+}
+
+static inline uint32_t enc_r(uint32_t opcode, uint32_t rd, uint32_t funct3, uint32_t rs1, uint32_t rs2, uint32_t funct7) {
+    return (funct7 << 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | opcode;
+}
+
+static inline uint32_t enc_s(uint32_t funct3, uint32_t rs1, uint32_t rs2, int64_t imm) {
+    return (((imm >> 5) & 0x7f) << 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12)
+        | ((imm & 0x1f) << 7) | OPCODE_STORE;
+}
+
+static inline uint32_t enc_b(uint32_t funct3, uint32_t rs1, uint32_t rs2, int64_t imm) {
+    return (((imm >> 12) & 1) << 31) | (((imm >> 5) & 0x3f) << 25) | (rs2 << 20) | (rs1 << 15)
+        | (funct3 << 12) | (((imm >> 1) & 0xf) << 8) | (((imm >> 11) & 1) << 7) | OPCODE_BRANCH;
+}
+
+static inline uint32_t enc_j(uint32_t rd, int64_t imm) {
+    return (((imm >> 20) & 1) << 31) | (((imm >> 1) & 0x3ff) << 21) | (((imm >> 11) & 1) << 20)
+        | (((imm >> 12) & 0xff) << 12) | (rd << 7) | OPCODE_JAL;
+}
+
+static inline uint32_t enc_u(uint32_t opcode, uint32_t rd, int64_t imm) {
+    return (imm & 0xfffff000) | (rd << 7) | opcode;
+}
+
 // CSR numbers
 
 static const uint32_t CSR_SSTATUS   = 0x100;
@@ -78,6 +132,7 @@ static const uintptr_t SCAUSE_LOAD_PF   = 13;
 static const uintptr_t SCAUSE_STORE_PF  = 15;
 
 static const uintptr_t SCAUSE_TIMER     = SCAUSE_IS_INT | 5;
+static const uintptr_t SCAUSE_EXTERNAL  = SCAUSE_IS_INT | 9;
 
 #define bitfield(name, start, width) \
     static const uintptr_t MASK_##name = (( ((uintptr_t) 1) << width ) - 1) << start;\
@@ -121,9 +176,13 @@ static const uintptr_t SSTATUS_WRITABLE_MASK =
 // sie and sip related
 
 bitfield(six_sti, 5, 1);
+bitfield(six_sei, 9, 1);
 
 static const uintptr_t SIX_WRITABLE_MASK = MASK_six_sti;
 
+// sip.SEIP is up to the devices, but sie.SEIE the guest can set
+static const uintptr_t SIE_WRITABLE_MASK = MASK_six_sti | MASK_six_sei;
+
 // satp related
 
 bitfield(satp_ppn, 0, 44)
@@ -156,15 +215,3 @@ bitfield(va_ppn2, 12, 9)
 bitfield(va_off, 0, 12)
 
 #undef bitfield
-
-inline bool rvc_looks_like_load(uint16_t instr) {
-    uint16_t op = instr & 0b11;
-    uint16_t funct3 = instr >> 13;
-    return (op == 0b00 || op == 0b10) && (funct3 == 0b001 || funct3 == 0b010 || funct3 == 0b011);
-}
-
-inline bool rvc_looks_like_store(uint16_t instr) {
-    uint16_t op = instr & 0b11;
-    uint16_t funct3 = instr >> 13;
-    return (op == 0b00 || op == 0b10) && (funct3 == 0b101 || funct3 == 0b110 || funct3 == 0b111);
-}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The URVirt block device, as guests see it
+
+static const uintptr_t URVIRT_BLOCK = 0x10400000;
+static const uintptr_t URVIRT_BLOCK_COMMAND = 0;
+static const uintptr_t URVIRT_BLOCK_BLOCK_ID = 8;
+static const uintptr_t URVIRT_BLOCK_BUF = 16;
+
+// Reads give the guest physical address of the register page. The device
+// only uses that page from the first read on, and copies the registers there
+// then. Until then it never writes guest RAM, count is 1 and async commands
+// are refused with -EINVAL.
+static const uintptr_t URVIRT_BLOCK_REGS = 24;
+
+// Transfer count blocks from block_id on, to or from the buffer at the guest
+// virtual address buf
+static const uintptr_t URVIRT_BLOCK_CMD_READ = 1;
+static const uintptr_t URVIRT_BLOCK_CMD_WRITE = 2;
+
+// Transfer what count descriptors say, from an array of struct
+// urvirt_block_desc at the guest physical address buf
+static const uintptr_t URVIRT_BLOCK_CMD_READ_LIST = 3;
+static const uintptr_t URVIRT_BLOCK_CMD_WRITE_LIST = 4;
+
+// Transfer count blocks from block_id on, to or from the guest physical
+// address buf, so the buffer needn't be mapped and is one range of RAM
+static const uintptr_t URVIRT_BLOCK_CMD_READ_PHYS = 5;
+static const uintptr_t URVIRT_BLOCK_CMD_WRITE_PHYS = 6;
+
+// Or'ed into a command, to have it done asynchronously. The write to the
+// command register returns right away, and once the transfer is done, a
+// struct urvirt_block_done with the tag register in it is put on the done
+// ring and the external interrupt is raised. If the guest already has
+// URVIRT_BLOCK_QUEUE of them, counting the ones still on the done ring, the
+// command is refused, and reading the command register gives -EBUSY rather
+// than 0 until the next command.
+static const uintptr_t URVIRT_BLOCK_CMD_ASYNC = 0x100;
+
+// Reads give the number of entries on the done ring. Writes, which the guest
+// does after taking entries off it, lower the external interrupt, unless the
+// ring still isn't empty.
+static const uintptr_t URVIRT_BLOCK_STATUS = 32;
+
+static const size_t URVIRT_BLOCK_SIZE = 512;
+
+// Most async commands a guest can have, counting the ones that are done but
+// still on the done ring
+#define URVIRT_BLOCK_QUEUE 16
+
+struct urvirt_block_done {
+    uint64_t tag;
+    int64_t result;         // Bytes transferred, or a negative errno
+};
+
+// The register page is in guest RAM, so stores to it don't trap. Only writing
+// the command register does, and the device reads the other registers from
+// the page then. The block id and buffer registers at URVIRT_BLOCK_BLOCK_ID
+// and URVIRT_BLOCK_BUF are the same ones, kept for guests that don't know
+// about the page.
+struct urvirt_block_regs {
+    uint64_t block_id;
+    uint64_t buf;
+    uint64_t count;         // Blocks, or descriptors for the list commands. 0
+                            // is the same as 1.
+    uint64_t tag;           // Handed back with async commands when done
+
+    // The done ring. The device puts entries at done_tail and the guest takes
+    // them from done_head, both counting up and used modulo
+    // URVIRT_BLOCK_QUEUE.
+    uint64_t done_head;     // Written by the guest
+    uint64_t done_tail;     // Written by the device
+    struct urvirt_block_done done[URVIRT_BLOCK_QUEUE];
+};
+
+struct urvirt_block_desc {
+    uint64_t block;         // Block on the disk
+    uint64_t pa;            // Guest physical address of the buffer
+    uint64_t len;           // Bytes, a multiple of URVIRT_BLOCK_SIZE, or the
+                            // command fails with -EINVAL
+};
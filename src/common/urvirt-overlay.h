@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdint.h>
+
+// Copy-on-write overlay images
+//
+// With an overlay, BLOCK_FD is a base image opened read-only, which any number
+// of guests can share, and DELTA_FD is this guest's own delta file. The delta
+// starts with this header, then has a bitmap of one bit per 512-byte block of
+// the disk, set if the block has been written and is in the delta, and then
+// the blocks themselves from data_offset on, each where it would be in the
+// base. The loader creates a delta with ftruncate, so it's sparse and takes
+// up disk space only for the blocks that have been written.
+
+static const uint64_t URVIRT_OVERLAY_MAGIC = 0x41544c4544565255;   // "URVDELTA"
+static const uint64_t URVIRT_OVERLAY_VERSION = 1;
+
+static const uint64_t URVIRT_OVERLAY_BLOCK = 512;
+
+struct urvirt_overlay_header {
+    uint64_t magic;
+    uint64_t version;
+    uint64_t disk_size;         // Bytes in the base
+    uint64_t bitmap_offset;     // Page aligned
+    uint64_t data_offset;       // Where block 0 is, page aligned
+};
+
+// Bytes of bitmap for a disk of disk_size bytes, rounded up to pages
+static inline uint64_t urvirt_overlay_bitmap_size(uint64_t disk_size) {
+    uint64_t blocks = (disk_size + URVIRT_OVERLAY_BLOCK - 1) / URVIRT_OVERLAY_BLOCK;
+    return ((blocks + 7) / 8 + 4095) & ~ 4095ull;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdint.h>
+
+// Paravirtual interface for guests that know they run on URVirt, shared by
+// the stub and the test kernel
+//
+// SBI calls in the vendor extension space use the SBI v0.2 convention: a7 is
+// the extension ID, a6 the function ID, and the result is an sbiret in a0 and
+// a1.
+
+// "URV" in the vendor extension range
+static const uintptr_t SBI_EXT_URVIRT = 0x09555256;
+
+// Turn on the shared CSR page and return its physical address
+static const uintptr_t SBI_URVIRT_PV_CSRS = 0;
+
+// The shared CSR page, with the CSRs in the order they are in struct
+// priv_state. Reading a field gives the value of the CSR as of the last trap.
+// Writing one is the same as a CSR write, done at the next trap, so a write
+// that enables a pending interrupt needs a trap, like a CSR read, to be taken.
+struct urvirt_pv_csrs {
+    uintptr_t sstatus;
+    uintptr_t sscratch;
+    uintptr_t stvec;
+    uintptr_t sepc;
+    uintptr_t scause;
+    uintptr_t stval;
+    uintptr_t sip;
+    uintptr_t sie;
+};
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The virtio-blk device, as guests see it
+//
+// A virtio-mmio block device, version 2 of the register layout, so
+// linux/virtio_mmio.h, linux/virtio_ring.h and linux/virtio_blk.h describe
+// it. It's where QEMU's virt machine has its first virtio-mmio device, so a
+// guest can use the same device tree node. It raises the external interrupt
+// directly, there's no PLIC, so VIRTIO_MMIO_INTERRUPT_STATUS tells whether it
+// was this device.
+//
+// It offers VIRTIO_F_VERSION_1, VIRTIO_RING_F_INDIRECT_DESC,
+// VIRTIO_RING_F_EVENT_IDX, VIRTIO_BLK_F_SEG_MAX, VIRTIO_BLK_F_BLK_SIZE and
+// VIRTIO_BLK_F_FLUSH, and has one queue of up to URVIRT_VIRTIO_QUEUE_MAX
+// entries. The request header has to be at the start of the first descriptor
+// of a chain, and the status byte at the end of the last.
+
+static const uintptr_t URVIRT_VIRTIO_BLK = 0x10001000;
+static const size_t URVIRT_VIRTIO_BLK_SIZE = 0x1000;
+
+#define URVIRT_VIRTIO_QUEUE_MAX 256
+
+// Data descriptors in a request at most, see virtio_blk_config.seg_max
+#define URVIRT_VIRTIO_SEG_MAX 126
@@ -0,0 +1,619 @@
+#include "sbi.h"
+
+#include <stdint.h>
+#include <linux/virtio_blk.h>
+#include <linux/virtio_config.h>
+#include <linux/virtio_mmio.h>
+#include <linux/virtio_ring.h>
+
+#include "riscv-bits.h"
+#include "urvirt-pv.h"
+#include "urvirt-block.h"
+#include "urvirt-virtio.h"
+
+// A guest kernel that measures how long various trapping operations take.
+// Results are in ticks of the `time` CSR per iteration. Run with `make bench`.
+//
+// The first few benchmarks run in S-mode without translation. After that the
+// kernel turns on Sv39, with RAM identity mapped for S-mode and mapped again
+// at USER_BASE for U-mode, and runs the rest as a U-mode program.
+//
+// The U-mode program also gets a scratch area of RAM, mapped a few times with
+// 4 KiB pages and once with 2 MiB megapages, to compare page fault costs.
+// Counters are dumped after each of those, so that the numbers of faults can
+// be compared too.
+//
+// In between, still in S-mode, the block device is benchmarked reading from
+// bench.img, in order and at random, one block per command through the
+// trapping registers, many per command through the register page, and one
+// per command with async commands, URVIRT_BLOCK_QUEUE of them at a time.
+// `make bench-block` runs them with copy_file_range and with preadv. Then the
+// same random reads go through virtio-blk, one request per notification and
+// 64, with and without indirect descriptors.
+//
+// Built with PV defined, as bench-pv.bin, the kernel turns on the shared CSR
+// page of urvirt-pv.h and its trap handler uses that instead of CSR
+// instructions. Compare the sigill per uecall counter with bench.bin, with
+// `make bench-pv`.
+
+static const uintptr_t MAGIC_DUMP_COUNTERS = 0xdeadbeefdeadbeefUL;
+
+static const size_t ITERS = 10000;
+
+static const uintptr_t RAM_BASE = 0x80000000;
+static const uintptr_t USER_BASE = 0x40000000;
+
+// Pages of RAM mapped, in units of 2 MiB
+#define RAM_MEGAS 8
+
+// The scratch area, the second half of RAM
+#define SCRATCH_MEGAS 4
+static const uintptr_t SCRATCH_BASE = 0x80800000;
+static const uintptr_t SCRATCH_PAGES_VA = 0x50000000;
+static const uintptr_t SCRATCH_MEGAS_VA = 0x60000000;
+static const uintptr_t SCRATCH_RANDOM_VA = 0x70000000;
+
+// Bench kernel 'system calls'
+static const uintptr_t SYS_NULL = 0;
+static const uintptr_t SYS_PUTCHAR = 1;
+static const uintptr_t SYS_EXIT = 2;
+static const uintptr_t SYS_DUMP = 3;
+
+typedef void (*putchar_fn)(char);
+
+#ifdef PV
+static volatile struct urvirt_pv_csrs *pv;
+#endif
+
+static inline uintptr_t rdtime() {
+    uintptr_t t;
+    asm volatile ("csrr %0, time" : "=r"(t) : : );
+    return t;
+}
+
+static void print_str(putchar_fn out, const char *s) {
+    for (; *s; s ++) {
+        out(*s);
+    }
+}
+
+static void print_dec(putchar_fn out, uintptr_t n) {
+    char buf[24];
+    int len = 0;
+    do {
+        buf[len ++] = '0' + n % 10;
+        n /= 10;
+    } while (n);
+    while (len) {
+        out(buf[-- len]);
+    }
+}
+
+static void report(putchar_fn out, const char *name, uintptr_t ticks, uintptr_t iters) {
+    print_str(out, "[bench] ");
+    print_str(out, name);
+    print_str(out, ": ");
+    print_dec(out, ticks / iters);
+    print_str(out, ".");
+    print_dec(out, ticks * 10 / iters % 10);
+    print_str(out, " ticks/iter\n");
+}
+
+static void kernel_putchar(char ch) {
+    sbi_console_putchar(ch);
+}
+
+static void dump_counters() {
+    sbi_call(SBI_CONSOLE_GETCHAR, MAGIC_DUMP_COUNTERS, 0, 0);
+}
+
+// S-mode benchmarks
+
+// SIGILL round trip: one emulated CSR read
+static void bench_csr_read() {
+    uintptr_t start = rdtime();
+    for (size_t i = 0; i < ITERS; i ++) {
+        uintptr_t val;
+        asm volatile ("csrr %0, sscratch" : "=r"(val) : : );
+    }
+    report(kernel_putchar, "csrr sscratch", rdtime() - start, ITERS);
+}
+
+// SIGSYS round trip: one legacy SBI call
+static void bench_sbi_call() {
+    uintptr_t start = rdtime();
+    for (size_t i = 0; i < ITERS; i ++) {
+        sbi_call(SBI_CONSOLE_GETCHAR, 0, 0, 0);
+    }
+    report(kernel_putchar, "sbi ecall", rdtime() - start, ITERS);
+}
+
+// Block device benchmarks, in S-mode with translation on. Results are per
+// block.
+
+// Blocks per command for the batched benchmarks
+#define BLOCK_BATCH 64
+
+// Blocks read by each benchmark, 2 MiB
+static const size_t BLOCK_ITERS = 4096;
+
+// bench.img is 64 MiB
+static const size_t DISK_BLOCKS = 64 << 11;
+
+__attribute__((aligned(4096))) static char block_buf[BLOCK_BATCH * 512];
+static struct urvirt_block_desc block_descs[BLOCK_BATCH];
+
+static inline volatile uint64_t *block_reg(uintptr_t offset) {
+    return (volatile uint64_t *) (URVIRT_BLOCK + offset);
+}
+
+// The i-th block to read, in order or all over the disk
+static inline uint64_t block_at(size_t i, int random) {
+    return random ? i * 1021 % DISK_BLOCKS : i;
+}
+
+// One block per command, the way it was before the register page, three
+// traps each
+static void bench_block_single(const char *name, int random) {
+    uintptr_t start = rdtime();
+    for (size_t i = 0; i < BLOCK_ITERS; i ++) {
+        *block_reg(URVIRT_BLOCK_BLOCK_ID) = block_at(i, random);
+        *block_reg(URVIRT_BLOCK_BUF) = (uintptr_t) block_buf;
+        *block_reg(URVIRT_BLOCK_COMMAND) = URVIRT_BLOCK_CMD_READ;
+    }
+    report(kernel_putchar, name, rdtime() - start, BLOCK_ITERS);
+}
+
+// BLOCK_BATCH blocks per command, through the register page. In order that's
+// a multi-block read, otherwise a descriptor list.
+static void bench_block_batch(const char *name, int random) {
+    volatile struct urvirt_block_regs *regs =
+        (volatile struct urvirt_block_regs *) *block_reg(URVIRT_BLOCK_REGS);
+
+    uintptr_t start = rdtime();
+    for (size_t i = 0; i < BLOCK_ITERS; i += BLOCK_BATCH) {
+        uintptr_t cmd;
+        if (random) {
+            for (size_t j = 0; j < BLOCK_BATCH; j ++) {
+                block_descs[j].block = block_at(i + j, random);
+                block_descs[j].pa = (uintptr_t) block_buf + j * URVIRT_BLOCK_SIZE;
+                block_descs[j].len = URVIRT_BLOCK_SIZE;
+            }
+            regs->buf = (uintptr_t) block_descs;
+            cmd = URVIRT_BLOCK_CMD_READ_LIST;
+        } else {
+            regs->block_id = i;
+            regs->buf = (uintptr_t) block_buf;
+            cmd = URVIRT_BLOCK_CMD_READ;
+        }
+        regs->count = BLOCK_BATCH;
+        *block_reg(URVIRT_BLOCK_COMMAND) = cmd;
+    }
+    report(kernel_putchar, name, rdtime() - start, BLOCK_ITERS);
+
+    regs->count = 0;
+}
+
+// BLOCK_BATCH blocks per command into one buffer by its physical address,
+// which is a single copy_file_range or preadv
+static void bench_block_phys(const char *name) {
+    volatile struct urvirt_block_regs *regs =
+        (volatile struct urvirt_block_regs *) *block_reg(URVIRT_BLOCK_REGS);
+
+    // S-mode is identity mapped
+    regs->buf = (uintptr_t) block_buf;
+    regs->count = BLOCK_BATCH;
+
+    uintptr_t start = rdtime();
+    for (size_t i = 0; i < BLOCK_ITERS; i += BLOCK_BATCH) {
+        regs->block_id = i;
+        *block_reg(URVIRT_BLOCK_COMMAND) = URVIRT_BLOCK_CMD_READ_PHYS;
+    }
+    report(kernel_putchar, name, rdtime() - start, BLOCK_ITERS);
+
+    regs->count = 0;
+}
+
+// One block per async command, keeping URVIRT_BLOCK_QUEUE of them going and
+// spinning on the done ring in memory, so completions come in with SIGIO.
+// Commands may finish out of order and read into a buffer that's still in
+// use, which doesn't matter here.
+static void bench_block_async(const char *name, int random) {
+    volatile struct urvirt_block_regs *regs =
+        (volatile struct urvirt_block_regs *) *block_reg(URVIRT_BLOCK_REGS);
+    uint64_t head = regs->done_head;
+    size_t submitted = 0, done = 0;
+
+    regs->count = 1;
+    uintptr_t start = rdtime();
+    while (done < BLOCK_ITERS) {
+        while (submitted < BLOCK_ITERS && submitted - done < URVIRT_BLOCK_QUEUE) {
+            regs->block_id = block_at(submitted, random);
+            regs->buf = (uintptr_t) block_buf + submitted % URVIRT_BLOCK_QUEUE * URVIRT_BLOCK_SIZE;
+            regs->tag = submitted;
+            *block_reg(URVIRT_BLOCK_COMMAND) = URVIRT_BLOCK_CMD_READ | URVIRT_BLOCK_CMD_ASYNC;
+            submitted ++;
+        }
+
+        while (regs->done_tail == head) {
+        }
+        for (; head != regs->done_tail; head ++) {
+            done ++;
+        }
+        regs->done_head = head;
+    }
+    report(kernel_putchar, name, rdtime() - start, BLOCK_ITERS);
+
+    // Interrupts are off, but lower it anyway
+    *block_reg(URVIRT_BLOCK_STATUS) = 0;
+    regs->count = 0;
+}
+
+// virtio-blk, a queue of direct descriptors, three per request, or indirect
+// ones, one per request
+
+#define VQ_SIZE URVIRT_VIRTIO_QUEUE_MAX
+
+__attribute__((aligned(4096))) static struct vring_desc vq_desc[VQ_SIZE];
+__attribute__((aligned(16))) static struct vring_desc vq_indirect[BLOCK_BATCH][3];
+
+// The rings, each followed by the index for event idx
+static struct {
+    uint16_t flags, idx, ring[VQ_SIZE], used_event;
+} vq_avail;
+static struct {
+    uint16_t flags, idx;
+    struct vring_used_elem ring[VQ_SIZE];
+    uint16_t avail_event;
+} vq_used;
+
+static struct virtio_blk_outhdr vq_hdr[BLOCK_BATCH];
+static uint8_t vq_status[BLOCK_BATCH];
+
+static inline volatile uint32_t *vblk_reg(uintptr_t offset) {
+    return (volatile uint32_t *) (URVIRT_VIRTIO_BLK + offset);
+}
+
+static void set_desc(struct vring_desc *d, void *addr, uint32_t len, uint16_t flags, uint16_t next) {
+    d->addr = (uintptr_t) addr;
+    d->len = len;
+    d->flags = flags;
+    d->next = next;
+}
+
+// Returns 0 if the device doesn't take the features
+static int vblk_setup() {
+    uint32_t status = VIRTIO_CONFIG_S_ACKNOWLEDGE | VIRTIO_CONFIG_S_DRIVER;
+    *vblk_reg(VIRTIO_MMIO_STATUS) = 0;
+    *vblk_reg(VIRTIO_MMIO_STATUS) = status;
+
+    *vblk_reg(VIRTIO_MMIO_DRIVER_FEATURES_SEL) = 0;
+    *vblk_reg(VIRTIO_MMIO_DRIVER_FEATURES) = (1u << VIRTIO_RING_F_INDIRECT_DESC) | (1u << VIRTIO_RING_F_EVENT_IDX);
+    *vblk_reg(VIRTIO_MMIO_DRIVER_FEATURES_SEL) = 1;
+    *vblk_reg(VIRTIO_MMIO_DRIVER_FEATURES) = 1u << (VIRTIO_F_VERSION_1 - 32);
+    status |= VIRTIO_CONFIG_S_FEATURES_OK;
+    *vblk_reg(VIRTIO_MMIO_STATUS) = status;
+    if (! (*vblk_reg(VIRTIO_MMIO_STATUS) & VIRTIO_CONFIG_S_FEATURES_OK)) {
+        return 0;
+    }
+
+    // S-mode is identity mapped
+    *vblk_reg(VIRTIO_MMIO_QUEUE_SEL) = 0;
+    *vblk_reg(VIRTIO_MMIO_QUEUE_NUM) = VQ_SIZE;
+    *vblk_reg(VIRTIO_MMIO_QUEUE_DESC_LOW) = (uintptr_t) vq_desc;
+    *vblk_reg(VIRTIO_MMIO_QUEUE_DESC_HIGH) = (uintptr_t) vq_desc >> 32;
+    *vblk_reg(VIRTIO_MMIO_QUEUE_AVAIL_LOW) = (uintptr_t) &vq_avail;
+    *vblk_reg(VIRTIO_MMIO_QUEUE_AVAIL_HIGH) = (uintptr_t) &vq_avail >> 32;
+    *vblk_reg(VIRTIO_MMIO_QUEUE_USED_LOW) = (uintptr_t) &vq_used;
+    *vblk_reg(VIRTIO_MMIO_QUEUE_USED_HIGH) = (uintptr_t) &vq_used >> 32;
+    *vblk_reg(VIRTIO_MMIO_QUEUE_READY) = 1;
+
+    *vblk_reg(VIRTIO_MMIO_STATUS) = status | VIRTIO_CONFIG_S_DRIVER_OK;
+    return 1;
+}
+
+// Random single block reads, batch requests per notification
+static void bench_vblk(const char *name, size_t batch, int indirect) {
+    volatile uint16_t *used_idx = &vq_used.idx;
+    uint16_t idx = vq_avail.idx;
+
+    uintptr_t start = rdtime();
+    for (size_t i = 0; i < BLOCK_ITERS; i += batch) {
+        for (size_t j = 0; j < batch; j ++) {
+            uint16_t head = indirect ? j : 3 * j;
+            struct vring_desc *d = indirect ? vq_indirect[j] : &vq_desc[head];
+            uint16_t next = indirect ? 0 : head;
+
+            vq_hdr[j].type = VIRTIO_BLK_T_IN;
+            vq_hdr[j].sector = block_at(i + j, 1);
+            set_desc(&d[0], &vq_hdr[j], sizeof(vq_hdr[j]), VRING_DESC_F_NEXT, next + 1);
+            set_desc(&d[1], block_buf + j * URVIRT_BLOCK_SIZE, URVIRT_BLOCK_SIZE,
+                VRING_DESC_F_WRITE | VRING_DESC_F_NEXT, next + 2);
+            set_desc(&d[2], &vq_status[j], 1, VRING_DESC_F_WRITE, 0);
+            if (indirect) {
+                set_desc(&vq_desc[head], d, sizeof(vq_indirect[j]), VRING_DESC_F_INDIRECT, 0);
+            }
+
+            vq_avail.ring[(uint16_t) (idx + j) % VQ_SIZE] = head;
+        }
+
+        uint16_t old = idx;
+        idx += batch;
+        __atomic_store_n(&vq_avail.idx, idx, __ATOMIC_RELEASE);
+        if (vring_need_event(*(volatile uint16_t *) &vq_used.avail_event, idx, old)) {
+            *vblk_reg(VIRTIO_MMIO_QUEUE_NOTIFY) = 0;
+        }
+
+        while (*used_idx != idx) {
+        }
+    }
+    report(kernel_putchar, name, rdtime() - start, BLOCK_ITERS);
+
+    // Interrupts are off, but lower it anyway
+    *vblk_reg(VIRTIO_MMIO_INTERRUPT_ACK) = *vblk_reg(VIRTIO_MMIO_INTERRUPT_STATUS);
+}
+
+static void bench_block() {
+    bench_block_single("block read", 0);
+    bench_block_single("block read, random", 1);
+    bench_block_batch("block read, 64 blocks", 0);
+    bench_block_batch("block read, 64 block list, random", 1);
+    bench_block_phys("block read, 64 blocks, physical");
+    bench_block_async("block read, async", 0);
+    bench_block_async("block read, async, random", 1);
+    if (vblk_setup()) {
+        bench_vblk("virtio-blk read, 1 per notify, random", 1, 0);
+        bench_vblk("virtio-blk read, 64 per notify, random", BLOCK_BATCH, 0);
+        bench_vblk("virtio-blk read, 64 per notify, indirect, random", BLOCK_BATCH, 1);
+    }
+    dump_counters();
+}
+
+// U-mode benchmarks
+
+static inline uintptr_t user_syscall(uintptr_t which, uintptr_t arg) {
+    register uintptr_t a0 asm ("a0") = arg;
+    register uintptr_t a7 asm ("a7") = which;
+    asm volatile ("ecall" : "+r"(a0) : "r"(a7) : "memory");
+    return a0;
+}
+
+static void user_putchar(char ch) {
+    user_syscall(SYS_PUTCHAR, ch);
+}
+
+// Full guest system call: U-mode ecall, S-mode trap handler, sret
+static void bench_user_syscall() {
+    uintptr_t start = rdtime();
+    for (size_t i = 0; i < ITERS; i ++) {
+        user_syscall(SYS_NULL, 0);
+    }
+    report(user_putchar, "user syscall", rdtime() - start, ITERS);
+}
+
+// First touch of every 4 KiB page of the scratch area mapped at va. With
+// stride 1 that's in order, with a large odd stride it's all over the place.
+static void bench_touch(const char *name, uintptr_t va, size_t stride) {
+    size_t pages = SCRATCH_MEGAS * 512;
+    uintptr_t start = rdtime();
+    for (size_t i = 0; i < pages; i ++) {
+        *(volatile char *) (va + ((i * stride % pages) << 12)) = 1;
+    }
+    report(user_putchar, name, rdtime() - start, pages);
+    user_syscall(SYS_DUMP, 0);
+}
+
+static void user_main() {
+    bench_user_syscall();
+    bench_touch("touch 4 KiB pages", SCRATCH_PAGES_VA, 1);
+    bench_touch("touch 4 KiB pages, random", SCRATCH_RANDOM_VA, 1021);
+    bench_touch("touch 2 MiB pages", SCRATCH_MEGAS_VA, 1);
+
+    user_syscall(SYS_EXIT, 0);
+}
+
+// Page tables
+
+__attribute__((aligned(4096))) static uint64_t pt_root[512];
+__attribute__((aligned(4096))) static uint64_t pt_mid_kernel[512];
+__attribute__((aligned(4096))) static uint64_t pt_mid_user[512];
+__attribute__((aligned(4096))) static uint64_t pt_mid_io[512];
+__attribute__((aligned(4096))) static uint64_t pt_leaf_kernel[RAM_MEGAS][512];
+__attribute__((aligned(4096))) static uint64_t pt_leaf_user[RAM_MEGAS][512];
+__attribute__((aligned(4096))) static uint64_t pt_leaf_scratch[2][SCRATCH_MEGAS][512];
+
+static inline uint64_t make_pte(uintptr_t pa, uint64_t flags) {
+    return ((pa >> 12) << 10) | flags | PTE_V;
+}
+
+static inline size_t mid_index(uintptr_t va) {
+    return (va >> 21) & 511;
+}
+
+// Map megas * 2 MiB from pa at va with 4 KiB pages, in the 1 GiB of address
+// space mid is for. va and pa must be 2 MiB aligned.
+static void map_pages(uint64_t *mid, uintptr_t va, uintptr_t pa, int megas, uint64_t (*leaf)[512], uint64_t flags) {
+    for (int i = 0; i < megas; i ++) {
+        mid[mid_index(va) + i] = make_pte((uintptr_t) leaf[i], 0);
+        for (int j = 0; j < 512; j ++) {
+            leaf[i][j] = make_pte(pa + (((uintptr_t) i * 512 + j) << 12), flags);
+        }
+    }
+}
+
+// Same as map_pages, but with 2 MiB megapages
+static void map_megapages(uint64_t *mid, uintptr_t va, uintptr_t pa, int megas, uint64_t flags) {
+    for (int i = 0; i < megas; i ++) {
+        mid[mid_index(va) + i] = make_pte(pa + ((uintptr_t) i << 21), flags);
+    }
+}
+
+static inline uintptr_t user_addr(const void *p) {
+    return (uintptr_t) p - RAM_BASE + USER_BASE;
+}
+
+// Trap handling
+
+struct trapframe {
+    uintptr_t x[32];
+};
+
+__attribute__((aligned(4096))) static char trap_stack[4096 * 4];
+__attribute__((aligned(4096))) static char user_stack[4096 * 4];
+
+void trap_handler(struct trapframe *tf) {
+    uintptr_t scause, sepc;
+#ifdef PV
+    scause = pv->scause;
+    sepc = pv->sepc;
+#else
+    asm volatile ("csrr %0, scause" : "=r"(scause));
+    asm volatile ("csrr %0, sepc" : "=r"(sepc));
+#endif
+
+    if (scause != SCAUSE_UECALL) {
+        print_str(kernel_putchar, "[bench] unexpected trap, scause = ");
+        print_dec(kernel_putchar, scause);
+        print_str(kernel_putchar, "\n");
+        sbi_shutdown();
+    }
+
+#ifdef PV
+    pv->sepc = sepc + 4;
+#else
+    asm volatile ("csrw sepc, %0" : : "r"(sepc + 4));
+#endif
+
+    uintptr_t which = tf->x[17];
+    if (which == SYS_PUTCHAR) {
+        sbi_console_putchar(tf->x[10]);
+    } else if (which == SYS_DUMP) {
+        dump_counters();
+    } else if (which == SYS_EXIT) {
+        dump_counters();
+        sbi_shutdown();
+    }
+}
+
+__attribute__((naked, aligned(4)))
+void trap_entry() {
+    asm(
+        "csrrw sp, sscratch, sp\n\t"
+        "addi sp, sp, -256\n\t"
+        "sd x1, 8(sp)\n\t"
+        "sd x3, 24(sp)\n\t"
+        "sd x4, 32(sp)\n\t"
+        "sd x5, 40(sp)\n\t"
+        "sd x6, 48(sp)\n\t"
+        "sd x7, 56(sp)\n\t"
+        "sd x8, 64(sp)\n\t"
+        "sd x9, 72(sp)\n\t"
+        "sd x10, 80(sp)\n\t"
+        "sd x11, 88(sp)\n\t"
+        "sd x12, 96(sp)\n\t"
+        "sd x13, 104(sp)\n\t"
+        "sd x14, 112(sp)\n\t"
+        "sd x15, 120(sp)\n\t"
+        "sd x16, 128(sp)\n\t"
+        "sd x17, 136(sp)\n\t"
+        "sd x18, 144(sp)\n\t"
+        "sd x19, 152(sp)\n\t"
+        "sd x20, 160(sp)\n\t"
+        "sd x21, 168(sp)\n\t"
+        "sd x22, 176(sp)\n\t"
+        "sd x23, 184(sp)\n\t"
+        "sd x24, 192(sp)\n\t"
+        "sd x25, 200(sp)\n\t"
+        "sd x26, 208(sp)\n\t"
+        "sd x27, 216(sp)\n\t"
+        "sd x28, 224(sp)\n\t"
+        "sd x29, 232(sp)\n\t"
+        "sd x30, 240(sp)\n\t"
+        "sd x31, 248(sp)\n\t"
+        "mv a0, sp\n\t"
+        "call trap_handler\n\t"
+        "ld x1, 8(sp)\n\t"
+        "ld x3, 24(sp)\n\t"
+        "ld x4, 32(sp)\n\t"
+        "ld x5, 40(sp)\n\t"
+        "ld x6, 48(sp)\n\t"
+        "ld x7, 56(sp)\n\t"
+        "ld x8, 64(sp)\n\t"
+        "ld x9, 72(sp)\n\t"
+        "ld x10, 80(sp)\n\t"
+        "ld x11, 88(sp)\n\t"
+        "ld x12, 96(sp)\n\t"
+        "ld x13, 104(sp)\n\t"
+        "ld x14, 112(sp)\n\t"
+        "ld x15, 120(sp)\n\t"
+        "ld x16, 128(sp)\n\t"
+        "ld x17, 136(sp)\n\t"
+        "ld x18, 144(sp)\n\t"
+        "ld x19, 152(sp)\n\t"
+        "ld x20, 160(sp)\n\t"
+        "ld x21, 168(sp)\n\t"
+        "ld x22, 176(sp)\n\t"
+        "ld x23, 184(sp)\n\t"
+        "ld x24, 192(sp)\n\t"
+        "ld x25, 200(sp)\n\t"
+        "ld x26, 208(sp)\n\t"
+        "ld x27, 216(sp)\n\t"
+        "ld x28, 224(sp)\n\t"
+        "ld x29, 232(sp)\n\t"
+        "ld x30, 240(sp)\n\t"
+        "ld x31, 248(sp)\n\t"
+        "addi sp, sp, 256\n\t"
+        "csrrw sp, sscratch, sp\n\t"
+        "sret\n\t"
+    );
+}
+
+void kernel_main() {
+#ifdef PV
+    struct sbiret ret = sbi_ecall(SBI_EXT_URVIRT, SBI_URVIRT_PV_CSRS, 0);
+    if (ret.error != 0) {
+        print_str(kernel_putchar, "[bench] no shared CSR page\n");
+        sbi_shutdown();
+    }
+    pv = (struct urvirt_pv_csrs *) ret.value;
+#endif
+
+    bench_csr_read();
+    bench_sbi_call();
+
+    uint64_t kernel_flags = PTE_R | PTE_W | PTE_X | PTE_A | PTE_D;
+    uint64_t user_flags = kernel_flags | PTE_U;
+
+    pt_root[(RAM_BASE >> 30) & 511] = make_pte((uintptr_t) pt_mid_kernel, 0);
+    map_pages(pt_mid_kernel, RAM_BASE, RAM_BASE, RAM_MEGAS, pt_leaf_kernel, kernel_flags);
+
+    pt_root[(USER_BASE >> 30) & 511] = make_pte((uintptr_t) pt_mid_user, 0);
+    map_pages(pt_mid_user, USER_BASE, RAM_BASE, RAM_MEGAS, pt_leaf_user, user_flags);
+    map_pages(pt_mid_user, SCRATCH_PAGES_VA, SCRATCH_BASE, SCRATCH_MEGAS, pt_leaf_scratch[0], user_flags & ~ PTE_X);
+    map_pages(pt_mid_user, SCRATCH_RANDOM_VA, SCRATCH_BASE, SCRATCH_MEGAS, pt_leaf_scratch[1], user_flags & ~ PTE_X);
+    map_megapages(pt_mid_user, SCRATCH_MEGAS_VA, SCRATCH_BASE, SCRATCH_MEGAS, user_flags & ~ PTE_X);
+
+    // The block devices, identity mapped for S-mode
+    pt_root[(URVIRT_BLOCK >> 30) & 511] = make_pte((uintptr_t) pt_mid_io, 0);
+    map_megapages(pt_mid_io, URVIRT_BLOCK, URVIRT_BLOCK, 1, kernel_flags & ~ PTE_X);
+    map_megapages(pt_mid_io, URVIRT_VIRTIO_BLK & ~ 0x1fffff, URVIRT_VIRTIO_BLK & ~ 0x1fffff, 1, kernel_flags & ~ PTE_X);
+
+    uintptr_t satp = (SATP_MODE_SV39 << 60) | ((uintptr_t) pt_root >> 12);
+    asm volatile ("csrw satp, %0\n\tsfence.vma" : : "r"(satp) : "memory");
+
+    bench_block();
+
+    asm volatile ("csrw stvec, %0" : : "r"(trap_entry));
+    asm volatile ("csrw sscratch, %0" : : "r"(trap_stack + sizeof(trap_stack)));
+    asm volatile ("csrc sstatus, %0" : : "r"(MASK_sstatus_spp));
+    asm volatile ("csrw sepc, %0" : : "r"(user_addr(user_main)));
+
+    asm volatile (
+        "mv sp, %0\n\t"
+        "sret\n\t"
+        :
+        : "r"(user_addr(user_stack + sizeof(user_stack)))
+        : "memory"
+    );
+    __builtin_unreachable();
+}
@@ -20,6 +20,24 @@ static inline uintptr_t sbi_call(size_t which, uintptr_t arg0, uintptr_t arg1, u
     return a0;
 }
 
+// SBI v0.2 call, for extensions
+struct sbiret {
+    uintptr_t error;
+    uintptr_t value;
+};
+
+static inline struct sbiret sbi_ecall(uintptr_t ext, uintptr_t fid, uintptr_t arg0) {
+    register uintptr_t a0 asm ("a0") = (uintptr_t)(arg0);
+    register uintptr_t a1 asm ("a1");
+    register uintptr_t a6 asm ("a6") = (uintptr_t)(fid);
+    register uintptr_t a7 asm ("a7") = (uintptr_t)(ext);
+    asm volatile ("ecall"
+                    : "+r" (a0), "=r" (a1)
+                    : "r" (a6), "r" (a7)
+                    : "memory");
+    struct sbiret ret = { a0, a1 };
+    return ret;
+}
 
 static inline void sbi_console_putchar(size_t c) {
     sbi_call(SBI_CONSOLE_PUTCHAR, c, 0, 0);
@@ -8,18 +8,211 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
 #include "common.h"
+#include "urvirt-overlay.h"
 
-int main(int argc, char *argv[]) {
-    if (argc != 4) {
-        fprintf(stderr, "Usage: %s <stub-image> <kernel-image> <fs-img>\n", argv[0]);
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [options] <stub-image> <kernel-image> <fs-img>\n", prog);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -a <pages>  Map up to this many pages around a page fault (default %zu, 1 to disable)\n",
+        DEFAULT_FAULT_AROUND);
+    fprintf(stderr, "  -b <mode>   Move block data with 'copy' (copy_file_range), 'preadv',\n");
+    fprintf(stderr, "              or 'auto', copy if the host allows it (default)\n");
+    fprintf(stderr, "  -e <leaves> Map whole address spaces with up to this many leaf PTEs on satp writes\n");
+    fprintf(stderr, "              (default 0, off)\n");
+    fprintf(stderr, "  -i <traps>  Interpret guest code that trapped this many times at one place\n");
+    fprintf(stderr, "              (default %zu, 0 for never)\n", DEFAULT_INTERP_HOT);
+    fprintf(stderr, "  -m <vmas>   Unmap pages to keep under this many host memory mappings (default %zu)\n",
+        DEFAULT_VMA_BUDGET);
+    fprintf(stderr, "  -o <delta>  Use <fs-img> as a read-only base image and write to the overlay\n");
+    fprintf(stderr, "              <delta>, which is created if it doesn't exist\n");
+    fprintf(stderr, "  -p <traps>  Patch CSR instructions that trapped this many times to not trap,\n");
+    fprintf(stderr, "              with trampolines in the guest RAM page below the kernel\n");
+    fprintf(stderr, "              (default %zu, never)\n", DEFAULT_PATCH_AFTER);
+    fprintf(stderr, "  -r <mode>   Load <fs-img> into memory and 'discard' writes on exit, or\n");
+    fprintf(stderr, "              'writeback' to write it back when the guest shuts down\n");
+    fprintf(stderr, "  -s <mode>   Trap guest ecalls with 'seccomp', 'dispatch' (syscall user dispatch),\n");
+    fprintf(stderr, "              or 'auto', dispatch if available (default)\n");
+    exit(1);
+}
+
+static size_t parse_size(const char *prog, const char *s, size_t min, size_t max) {
+    char *end;
+    unsigned long val = strtoul(s, &end, 0);
+    if (*s == '\0' || *end != '\0' || val < min || val > max) {
+        fprintf(stderr, "%s: bad number '%s', should be %zu to %zu\n", prog, s, min, max);
+        usage(prog);
+    }
+    return val;
+}
+
+// Open the overlay delta as DELTA_FD, creating it for the base image at
+// BLOCK_FD if it's not there. Creating it only writes the header, however
+// large the base is.
+static void open_delta(const char *prog, const char *path) {
+    struct stat base_stat;
+    fstat(BLOCK_FD, &base_stat);
+
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        perror(path);
+        exit(1);
+    }
+
+    struct urvirt_overlay_header header;
+    ssize_t got = pread(fd, &header, sizeof(header), 0);
+
+    if (got == 0) {
+        header.magic = URVIRT_OVERLAY_MAGIC;
+        header.version = URVIRT_OVERLAY_VERSION;
+        header.disk_size = base_stat.st_size;
+        header.bitmap_offset = 4096;
+        header.data_offset = header.bitmap_offset + urvirt_overlay_bitmap_size(header.disk_size);
+        if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header)
+            || ftruncate(fd, header.data_offset + header.disk_size) != 0) {
+            perror(path);
+            exit(1);
+        }
+    } else if (got != sizeof(header) || header.magic != URVIRT_OVERLAY_MAGIC
+        || header.version != URVIRT_OVERLAY_VERSION) {
+        fprintf(stderr, "%s: %s is not an overlay delta\n", prog, path);
+        exit(1);
+    } else if (header.disk_size != (uint64_t) base_stat.st_size) {
+        fprintf(stderr, "%s: %s is for a base of %zu bytes, not %zu\n", prog, path,
+            (size_t) header.disk_size, (size_t) base_stat.st_size);
         exit(1);
     }
 
-    int stub_img_fd = open(argv[1], O_RDONLY);
+    dup2(fd, DELTA_FD);
+    close(fd);
+}
+
+// Read the disk image at path into a memfd at BLOCK_FD, keeping the image at
+// IMAGE_FD to write it back to if that's asked for
+static void load_ramdisk(const char *path, int ramdisk) {
+    int img_fd = open(path, ramdisk == RAMDISK_WRITEBACK ? O_RDWR : O_RDONLY);
+    if (img_fd < 0) {
+        perror(path);
+        exit(1);
+    }
+
+    struct stat img_stat;
+    fstat(img_fd, &img_stat);
+
+    int block_fd_orig = memfd_create("block_fd", 0);
+    ftruncate(block_fd_orig, img_stat.st_size);
+
+    off_t offset = 0;
+    while (offset < img_stat.st_size) {
+        ssize_t res = sendfile(block_fd_orig, img_fd, &offset, img_stat.st_size - offset);
+        if (res <= 0) {
+            perror(path);
+            exit(1);
+        }
+    }
+
+    dup2(block_fd_orig, BLOCK_FD);
+    close(block_fd_orig);
+
+    if (ramdisk == RAMDISK_WRITEBACK) {
+        dup2(img_fd, IMAGE_FD);
+    }
+    close(img_fd);
+}
+
+int main(int argc, char *argv[]) {
+    struct urvirt_options opts = {
+        .fault_around = DEFAULT_FAULT_AROUND,
+        .vma_budget = DEFAULT_VMA_BUDGET,
+        .ecall_mode = ECALL_AUTO,
+        .interp_hot = DEFAULT_INTERP_HOT,
+        .patch_after = DEFAULT_PATCH_AFTER,
+        .block_copy = BLOCK_COPY_AUTO,
+        .ramdisk = RAMDISK_OFF,
+    };
+
+    const char *delta_img = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "a:b:e:i:m:o:p:r:s:")) != -1) {
+        switch (opt) {
+        case 'a':
+            // No more than one leaf page table
+            opts.fault_around = parse_size(argv[0], optarg, 1, 512);
+            break;
+        case 'b':
+            if (strcmp(optarg, "auto") == 0) {
+                opts.block_copy = BLOCK_COPY_AUTO;
+            } else if (strcmp(optarg, "copy") == 0) {
+                opts.block_copy = BLOCK_COPY_RANGE;
+            } else if (strcmp(optarg, "preadv") == 0) {
+                opts.block_copy = BLOCK_COPY_PREADV;
+            } else {
+                fprintf(stderr, "%s: bad block copy mode '%s'\n", argv[0], optarg);
+                usage(argv[0]);
+            }
+            break;
+        case 'e':
+            opts.eager_leaves = parse_size(argv[0], optarg, 0, SIZE_MAX);
+            break;
+        case 'i':
+            opts.interp_hot = parse_size(argv[0], optarg, 0, SIZE_MAX);
+            break;
+        case 'm':
+            opts.vma_budget = parse_size(argv[0], optarg, 256, SIZE_MAX);
+            break;
+        case 'o':
+            delta_img = optarg;
+            opts.overlay = 1;
+            break;
+        case 'p':
+            opts.patch_after = parse_size(argv[0], optarg, 0, SIZE_MAX);
+            break;
+        case 'r':
+            if (strcmp(optarg, "discard") == 0) {
+                opts.ramdisk = RAMDISK_DISCARD;
+            } else if (strcmp(optarg, "writeback") == 0) {
+                opts.ramdisk = RAMDISK_WRITEBACK;
+            } else {
+                fprintf(stderr, "%s: bad RAM disk mode '%s'\n", argv[0], optarg);
+                usage(argv[0]);
+            }
+            break;
+        case 's':
+            if (strcmp(optarg, "auto") == 0) {
+                opts.ecall_mode = ECALL_AUTO;
+            } else if (strcmp(optarg, "seccomp") == 0) {
+                opts.ecall_mode = ECALL_SECCOMP;
+            } else if (strcmp(optarg, "dispatch") == 0) {
+                opts.ecall_mode = ECALL_DISPATCH;
+            } else {
+                fprintf(stderr, "%s: bad ecall mode '%s'\n", argv[0], optarg);
+                usage(argv[0]);
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (argc - optind != 3) {
+        usage(argv[0]);
+    }
+
+    if (opts.overlay && opts.ramdisk == RAMDISK_WRITEBACK) {
+        fprintf(stderr, "%s: an overlay base is read-only, there's nothing to write back\n", argv[0]);
+        usage(argv[0]);
+    }
+
+    const char *stub_img = argv[optind];
+    const char *kernel_img = argv[optind + 1];
+    const char *fs_img = argv[optind + 2];
+
+    int stub_img_fd = open(stub_img, O_RDONLY);
 
     struct stat img_stat;
     fstat(stub_img_fd, &img_stat);
@@ -39,7 +232,7 @@ int main(int argc, char *argv[]) {
 
     close(stub_img_fd);
 
-    int kernel_img_fd = open(argv[2], O_RDONLY);
+    int kernel_img_fd = open(kernel_img, O_RDONLY);
     fstat(kernel_img_fd, &img_stat);
 
     size_t kernel_size = img_stat.st_size;
@@ -59,9 +252,17 @@ int main(int argc, char *argv[]) {
     close(config_fd_orig);
     close(ram_fd_orig);
 
-    int block_fd_orig = open(argv[3], O_RDWR);
-    dup2(block_fd_orig, BLOCK_FD);
-    close(block_fd_orig);
+    if (opts.ramdisk != RAMDISK_OFF) {
+        load_ramdisk(fs_img, opts.ramdisk);
+    } else {
+        int block_fd_orig = open(fs_img, delta_img != NULL ? O_RDONLY : O_RDWR);
+        dup2(block_fd_orig, BLOCK_FD);
+        close(block_fd_orig);
+    }
+
+    if (delta_img != NULL) {
+        open_delta(argv[0], delta_img);
+    }
 
     struct urvirt_config *conf = (struct urvirt_config *) mmap(
         NULL, CONF_SIZE,
@@ -72,6 +273,7 @@ int main(int argc, char *argv[]) {
     conf->stub_start = stub_addr;
     conf->stub_size = file_size_up;
     conf->kernel_size = kernel_size;
+    conf->opts = opts;
 
     munmap(conf, CONF_SIZE);
 
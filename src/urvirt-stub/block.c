@@ -0,0 +1,680 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+
+#include "block.h"
+#include "disk.h"
+#include "riscv-bits.h"
+#include "stub-layout.h"
+#include "shadow-vm.h"
+#include "patch.h"
+#include "printf.h"
+
+#include "urvirt-syscalls.h"
+
+static inline struct urvirt_block_regs *urvb_regs() {
+    struct urvb_state *st = get_urvb();
+    return st->regs_on_page ? ram_ptr(URVIRT_BLOCK_REGS_PA) : &st->regs;
+}
+
+// The device changed the registers
+static void regs_written(struct priv_state *priv) {
+    if (get_urvb()->regs_on_page) {
+        shadow_phys_written(priv, URVIRT_BLOCK_REGS_PA, sizeof(struct urvirt_block_regs));
+    }
+}
+
+// Move the registers to the page, the first time the guest asks for it
+static void regs_to_page(struct priv_state *priv) {
+    struct urvb_state *st = get_urvb();
+    if (st->regs_on_page) {
+        return;
+    }
+
+    patch_phys_access(priv, URVIRT_BLOCK_REGS_PA, sizeof(struct urvirt_block_regs), false);
+    // Not a struct copy, which could be a call to memcpy
+    uint64_t *page = ram_ptr(URVIRT_BLOCK_REGS_PA);
+    const uint64_t *regs = (const uint64_t *) &st->regs;
+    for (size_t i = 0; i < sizeof(st->regs) / 8; i ++) {
+        page[i] = regs[i];
+    }
+    st->regs_on_page = true;
+    regs_written(priv);
+}
+
+// Buffers in guest RAM for one command, split in runs that are one after
+// another on the disk. Each run is one preadv or pwritev, or one SQE for
+// async commands.
+struct urvb_batch {
+    struct iovec *iov;
+    int max;                // Room in iov
+    int n;
+    int start;              // First iovec of the run
+    off_t offset;           // Where the run is on the disk
+    size_t len;             // Bytes in the run
+    bool write;             // To the disk
+    int64_t result;         // Bytes so far, or the first error
+    struct urvb_req *req;   // The async command, NULL if done right away
+};
+
+// Add up transfer results, keeping the first error
+static void add_result(int64_t *result, int64_t res) {
+    if (*result >= 0) {
+        *result = res < 0 ? res : *result + res;
+    }
+}
+
+static void mark_written(struct priv_state *priv, const struct iovec *iov, int n) {
+    for (int i = 0; i < n; i ++) {
+        uintptr_t pa = (char *) iov[i].iov_base - get_ram_window() + RAM_START;
+        shadow_phys_written(priv, pa, iov[i].iov_len);
+    }
+}
+
+// Hand what's on the submission queue to the kernel, and wait for at least
+// min_complete completions
+static void submit(struct urvb_state *st, unsigned min_complete) {
+    unsigned to_submit = *st->sq_tail - __atomic_load_n(st->sq_head, __ATOMIC_ACQUIRE);
+    s_io_uring_enter(st->ring_fd, to_submit, min_complete, min_complete != 0 ? IORING_ENTER_GETEVENTS : 0);
+}
+
+// Make room for n more SQEs, and their CQEs
+static void reserve(struct priv_state *priv, struct urvb_state *st, uint32_t n) {
+    if (*st->sq_tail - __atomic_load_n(st->sq_head, __ATOMIC_ACQUIRE) + n > st->sq_entries) {
+        submit(st, 0);
+    }
+    while (st->inflight + n > st->cq_entries) {
+        submit(st, 1);
+        urvb_poll(priv);
+    }
+}
+
+static struct io_uring_sqe *next_sqe(struct urvb_state *st) {
+    uint32_t tail = *st->sq_tail;
+    uint32_t i = tail & st->sq_mask;
+    struct io_uring_sqe *sqe = &st->sqes[i];
+
+    for (char *p = (char *) sqe; p < (char *) (sqe + 1); p ++) {
+        *p = 0;
+    }
+    st->sq_array[i] = i;
+    __atomic_store_n(st->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    st->inflight ++;
+    return sqe;
+}
+
+// user_data of the pipe writes
+static const uint64_t URVB_WAKE = ~ 0ull;
+
+// user_data of transfers has the request in the low byte and the run of it
+// above that
+
+static void queue_run(struct priv_state *priv, struct urvb_req *req, const struct iovec *iov, int n, size_t len, off_t offset) {
+    struct urvb_state *st = get_urvb();
+
+    int fd;
+    off_t file_offset;
+    if (! disk_locate(priv, offset, len, req->write, &fd, &file_offset)) {
+        // A read from both the overlay base and the delta, done right away
+        ssize_t res = disk_preadv(priv, iov, n, offset);
+        add_result(&req->result, res);
+        priv->counter_block_syscalls ++;
+        priv->counter_block_bytes += len;
+        return;
+    }
+
+    reserve(priv, st, 2);
+
+    struct io_uring_sqe *sqe = next_sqe(st);
+    sqe->opcode = req->write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->flags = IOSQE_IO_HARDLINK;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t) iov;
+    sqe->len = n;
+    sqe->off = file_offset;
+    sqe->user_data = (req - st->reqs) | (uint64_t) req->n_runs << 8;
+
+    req->runs[req->n_runs].offset = offset;
+    req->runs[req->n_runs].len = len;
+    req->n_runs ++;
+
+    // Runs even if the transfer fails
+    sqe = next_sqe(st);
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = st->wake_fd;
+    sqe->addr = (uintptr_t) &st->wake_byte;
+    sqe->len = 1;
+    sqe->off = -1;
+    sqe->user_data = URVB_WAKE;
+
+    req->sqes ++;
+}
+
+// Move the one buffer of b with copy_file_range between the disk and RAM_FD,
+// so the data goes from file to file in the host kernel. Returns false if it
+// has to be preadv this time, when a read is from both the overlay base and
+// the delta, or from now on, when the host can't do it between the two.
+static bool copy_range(struct priv_state *priv, struct urvb_batch *b, ssize_t *res) {
+    int fd;
+    off_t disk;
+    if (! disk_locate(priv, b->offset, b->len, b->write, &fd, &disk)) {
+        return false;
+    }
+
+    off_t ram = (char *) b->iov[0].iov_base - get_ram_window();
+    size_t done = 0;
+    ssize_t ret = 0;
+
+    while (done < b->len) {
+        ret = b->write
+            ? s_copy_file_range(RAM_FD, &ram, fd, &disk, b->len - done, 0)
+            : s_copy_file_range(fd, &disk, RAM_FD, &ram, b->len - done, 0);
+        priv->counter_block_syscalls ++;
+        if (ret <= 0) {
+            break;
+        }
+        done += ret;
+    }
+    if (b->write && done != 0) {
+        disk_written(priv, b->offset, b->len, done);
+    }
+
+    // Newer hosts only do it within one kind of file system, and RAM_FD is a
+    // memfd
+    if (done == 0 && (ret == -EXDEV || ret == -EINVAL || ret == -ENOSYS || ret == -EOPNOTSUPP)) {
+        if (priv->opts.block_copy == BLOCK_COPY_RANGE) {
+            write_log("copy_file_range is not available for the block device");
+            s_exit_group(1);
+        }
+        write_log("copy_file_range doesn't work on the block device, using preadv");
+        priv->block_copy = BLOCK_COPY_PREADV;
+        return false;
+    }
+    priv->block_copy = BLOCK_COPY_RANGE;
+
+    *res = done != 0 || ret == 0 ? (ssize_t) done : ret;
+    return true;
+}
+
+static void run_flush(struct priv_state *priv, struct urvb_batch *b) {
+    if (b->n == b->start) {
+        return;
+    }
+
+    if (b->req != NULL) {
+        queue_run(priv, b->req, b->iov + b->start, b->n - b->start, b->len, b->offset);
+        b->start = b->n;
+        b->len = 0;
+        return;
+    }
+
+    ssize_t res;
+    if (b->n != 1 || priv->block_copy == BLOCK_COPY_PREADV || ! copy_range(priv, b, &res)) {
+        res = b->write
+            ? disk_pwritev(priv, b->iov, b->n, b->offset)
+            : disk_preadv(priv, b->iov, b->n, b->offset);
+        priv->counter_block_syscalls ++;
+    }
+    if (res != (ssize_t) b->len) {
+        printf("[urvirt] urvirt block transfer of %zd bytes at %zd did %zd\n", b->len, b->offset, res);
+    }
+    add_result(&b->result, res);
+
+    if (! b->write) {
+        mark_written(priv, b->iov, b->n);
+    }
+
+    priv->counter_block_bytes += b->len;
+    b->n = 0;
+    b->len = 0;
+}
+
+// Add len bytes of guest RAM at pa, which go to or come from offset on the
+// disk. Returns false if there's no room for them.
+static bool batch_add(struct priv_state *priv, struct urvb_batch *b, uintptr_t pa, size_t len, off_t offset) {
+    if (b->n != b->start && b->offset + b->len != offset) {
+        run_flush(priv, b);
+    }
+
+    // Never patched code to the disk, or over it
+    patch_phys_access(priv, pa, len, false);
+
+    char *p = ram_ptr(pa);
+    if (b->n != b->start && (char *) b->iov[b->n - 1].iov_base + b->iov[b->n - 1].iov_len == p) {
+        b->iov[b->n - 1].iov_len += len;
+    } else {
+        if (b->n == b->max) {
+            run_flush(priv, b);
+        }
+        if (b->n == b->max) {
+            // Async, the iovecs have to stay until it's done
+            printf("[urvirt] urvirt block command has more than %d buffers\n", b->max);
+            add_result(&b->result, -E2BIG);
+            return false;
+        }
+        if (b->n == b->start) {
+            b->offset = offset;
+        }
+        b->iov[b->n].iov_base = p;
+        b->iov[b->n].iov_len = len;
+        b->n ++;
+    }
+    b->len += len;
+    return true;
+}
+
+// Add count blocks between the disk and the buffer at the guest virtual
+// address buf. The buffer is accessed through the RAM window one page at a
+// time, so it need not be mapped. count is only on the register page, so for
+// a guest that hasn't asked for that, it stays 0, one block.
+static void transfer(struct priv_state *priv, struct urvb_batch *b, struct urvirt_block_regs *regs) {
+    size_t count = regs->count == 0 ? 1 : regs->count;
+    off_t offset = URVIRT_BLOCK_SIZE * regs->block_id;
+
+    // More than all of RAM can't be, and would overflow
+    if (count > RAM_SIZE / URVIRT_BLOCK_SIZE) {
+        printf("[urvirt] urvirt block buffer of %zd blocks is larger than RAM\n", count);
+        add_result(&b->result, -EFAULT);
+        return;
+    }
+    size_t total = URVIRT_BLOCK_SIZE * count;
+
+    // Reading from the disk writes to the buffer
+    uintptr_t scause = b->write ? SCAUSE_LOAD_PF : SCAUSE_STORE_PF;
+
+    for (size_t done = 0; done < total; ) {
+        uintptr_t va = regs->buf + done;
+        size_t len = 4096 - (va & 4095);
+        if (len > total - done) {
+            len = total - done;
+        }
+
+        uintptr_t pa;
+        if (guest_access(priv, va, len, scause, &pa) == NULL) {
+            printf("[urvirt] urvirt block buffer 0x%zx is not in RAM\n", va);
+            add_result(&b->result, -EFAULT);
+            break;
+        }
+
+        if (! batch_add(priv, b, pa, len, offset + done)) {
+            break;
+        }
+        done += len;
+    }
+}
+
+// Add count blocks between the disk and the guest physical address buf
+static void transfer_phys(struct priv_state *priv, struct urvb_batch *b, struct urvirt_block_regs *regs) {
+    size_t count = regs->count == 0 ? 1 : regs->count;
+
+    if (count > RAM_SIZE / URVIRT_BLOCK_SIZE || ! is_ram_range(regs->buf, count * URVIRT_BLOCK_SIZE)) {
+        printf("[urvirt] urvirt block buffer 0x%zx is not in RAM\n", regs->buf);
+        add_result(&b->result, -EFAULT);
+        return;
+    }
+
+    batch_add(priv, b, regs->buf, count * URVIRT_BLOCK_SIZE, URVIRT_BLOCK_SIZE * regs->block_id);
+}
+
+// Add what the descriptors at the guest physical address buf say
+static void transfer_list(struct priv_state *priv, struct urvb_batch *b, struct urvirt_block_regs *regs) {
+    size_t count = regs->count == 0 ? 1 : regs->count;
+
+    if (count > RAM_SIZE / sizeof(struct urvirt_block_desc)
+        || ! is_ram_range(regs->buf, count * sizeof(struct urvirt_block_desc))) {
+        printf("[urvirt] urvirt block descriptors at 0x%zx are not in RAM\n", regs->buf);
+        add_result(&b->result, -EFAULT);
+        return;
+    }
+
+    // Whole blocks only, as the overlay can't do less, see disk.h. The command
+    // isn't done at all then.
+    struct urvirt_block_desc *desc = ram_ptr(regs->buf);
+    for (size_t i = 0; i < count; i ++) {
+        if (desc[i].len % URVIRT_BLOCK_SIZE != 0) {
+            printf("[urvirt] urvirt block descriptor of %zd bytes is not whole blocks\n", desc[i].len);
+            add_result(&b->result, -EINVAL);
+            return;
+        }
+    }
+
+    for (size_t i = 0; i < count; i ++) {
+        if (! is_ram_range(desc[i].pa, desc[i].len)) {
+            printf("[urvirt] urvirt block buffer 0x%zx is not in RAM\n", desc[i].pa);
+            add_result(&b->result, -EFAULT);
+            break;
+        }
+        if (! batch_add(priv, b, desc[i].pa, desc[i].len, URVIRT_BLOCK_SIZE * desc[i].block)) {
+            break;
+        }
+    }
+}
+
+// The external interrupt is up while the done ring isn't empty
+static void update_irq(struct priv_state *priv) {
+    struct urvirt_block_regs *regs = urvb_regs();
+    set_external_irq(priv, EXT_IRQ_URVB, regs->done_tail != regs->done_head);
+}
+
+static void complete(struct priv_state *priv, struct urvb_req *req) {
+    struct urvirt_block_regs *regs = urvb_regs();
+
+    if (! req->write) {
+        mark_written(priv, req->iov, req->n_iov);
+    }
+
+    struct urvirt_block_done *done = &regs->done[regs->done_tail % URVIRT_BLOCK_QUEUE];
+    done->tag = req->tag;
+    done->result = req->result;
+    regs->done_tail ++;
+    regs_written(priv);
+
+    req->busy = false;
+    priv->counter_block_async ++;
+    update_irq(priv);
+}
+
+void urvb_poll(struct priv_state *priv) {
+    struct urvb_state *st = get_urvb();
+    if (st->ring_fd < 0) {
+        return;
+    }
+
+    uint32_t head = *st->cq_head;
+    uint32_t tail = __atomic_load_n(st->cq_tail, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+        return;
+    }
+
+    for (; head != tail; head ++) {
+        struct io_uring_cqe *cqe = &st->cqes[head & st->cq_mask];
+        st->inflight --;
+        if (cqe->user_data == URVB_WAKE) {
+            continue;
+        }
+
+        struct urvb_req *req = &st->reqs[cqe->user_data & 0xff];
+        add_result(&req->result, cqe->res);
+        if (cqe->res > 0) {
+            priv->counter_block_bytes += cqe->res;
+            if (req->write) {
+                struct urvb_run *run = &req->runs[cqe->user_data >> 8];
+                disk_written(priv, run->offset, run->len, cqe->res);
+            }
+        }
+        req->sqes --;
+        if (req->sqes == 0 && ! req->submitting) {
+            complete(priv, req);
+        }
+    }
+    __atomic_store_n(st->cq_head, head, __ATOMIC_RELEASE);
+
+    // Empty the pipe, so that it never fills up
+    char buf[64];
+    while (s_read(st->wake_read_fd, buf, sizeof(buf)) == sizeof(buf)) {
+    }
+}
+
+void urvb_drain(struct priv_state *priv) {
+    struct urvb_state *st = get_urvb();
+    if (st->ring_fd < 0) {
+        return;
+    }
+
+    while (st->inflight != 0) {
+        submit(st, 1);
+        urvb_poll(priv);
+    }
+}
+
+// A free request, waiting for one if the guest is at URVIRT_BLOCK_QUEUE.
+// Returns NULL if only the guest can free one, by taking entries off the done
+// ring.
+static struct urvb_req *alloc_req(struct priv_state *priv, struct urvb_state *st) {
+    struct urvirt_block_regs *regs = urvb_regs();
+
+    for (;;) {
+        struct urvb_req *slot = NULL;
+        uint64_t busy = 0;
+        for (int i = 0; i < URVIRT_BLOCK_QUEUE; i ++) {
+            if (st->reqs[i].busy) {
+                busy ++;
+            } else {
+                slot = &st->reqs[i];
+            }
+        }
+
+        uint64_t unread = regs->done_tail - regs->done_head;
+        if (unread <= URVIRT_BLOCK_QUEUE && busy + unread < URVIRT_BLOCK_QUEUE) {
+            return slot;
+        }
+        if (busy == 0) {
+            return NULL;
+        }
+
+        submit(st, 1);
+        urvb_poll(priv);
+    }
+}
+
+// Where the buffers of a command are
+static const int BUF_VIRT = 0;      // At the guest virtual address buf
+static const int BUF_LIST = 1;      // Described at the guest physical address buf
+static const int BUF_PHYS = 2;      // At the guest physical address buf
+
+static void add_buffers(struct priv_state *priv, struct urvb_batch *b, struct urvirt_block_regs *regs, int bufs) {
+    if (bufs == BUF_LIST) {
+        transfer_list(priv, b, regs);
+    } else if (bufs == BUF_PHYS) {
+        transfer_phys(priv, b, regs);
+    } else {
+        transfer(priv, b, regs);
+    }
+}
+
+static void command_async(struct priv_state *priv, struct urvirt_block_regs *regs, bool write, int bufs) {
+    struct urvb_state *st = get_urvb();
+    struct urvb_req *req = alloc_req(priv, st);
+    if (req == NULL) {
+        st->command_result = -EBUSY;
+        return;
+    }
+
+    req->busy = true;
+    req->write = write;
+    req->submitting = true;
+    req->tag = regs->tag;
+    req->sqes = 0;
+    req->n_runs = 0;
+    req->result = 0;
+
+    struct urvb_batch b = {
+        .iov = req->iov, .max = URVB_REQ_IOVS, .n = 0, .start = 0, .len = 0,
+        .write = write, .result = 0, .req = st->ring_fd >= 0 ? req : NULL,
+    };
+    add_buffers(priv, &b, regs, bufs);
+    run_flush(priv, &b);
+
+    // Without a ring everything is done already, and the iovecs are reused
+    req->n_iov = b.req != NULL ? b.n : 0;
+    add_result(&req->result, b.result);
+    req->submitting = false;
+
+    if (b.req != NULL) {
+        submit(st, 0);
+        priv->counter_block_syscalls ++;
+    }
+    if (req->sqes == 0) {
+        complete(priv, req);
+    }
+}
+
+static void command(struct priv_state *priv, uintptr_t cmd) {
+    struct urvirt_block_regs *regs = urvb_regs();
+    bool async = (cmd & URVIRT_BLOCK_CMD_ASYNC) != 0;
+    bool write;
+    int bufs;
+
+    priv->counter_block_cmds ++;
+    get_urvb()->command_result = 0;
+
+    cmd &= ~ URVIRT_BLOCK_CMD_ASYNC;
+    if (cmd == URVIRT_BLOCK_CMD_READ || cmd == URVIRT_BLOCK_CMD_WRITE) {
+        write = cmd == URVIRT_BLOCK_CMD_WRITE;
+        bufs = BUF_VIRT;
+    } else if (cmd == URVIRT_BLOCK_CMD_READ_LIST || cmd == URVIRT_BLOCK_CMD_WRITE_LIST) {
+        write = cmd == URVIRT_BLOCK_CMD_WRITE_LIST;
+        bufs = BUF_LIST;
+    } else if (cmd == URVIRT_BLOCK_CMD_READ_PHYS || cmd == URVIRT_BLOCK_CMD_WRITE_PHYS) {
+        write = cmd == URVIRT_BLOCK_CMD_WRITE_PHYS;
+        bufs = BUF_PHYS;
+    } else {
+        printf("[urvirt] urvirt block command %zd unknown\n", cmd);
+        asm("ebreak");
+        return;
+    }
+
+    if (async && ! get_urvb()->regs_on_page) {
+        // Without the page, there's no done ring for the guest to see
+        get_urvb()->command_result = -EINVAL;
+        return;
+    } else if (async) {
+        command_async(priv, regs, write, bufs);
+        return;
+    }
+
+    struct iovec iov[URVB_IOVS];
+    struct urvb_batch b = {
+        .iov = iov, .max = URVB_IOVS, .n = 0, .start = 0, .len = 0,
+        .write = write, .result = 0, .req = NULL,
+    };
+    add_buffers(priv, &b, regs, bufs);
+    run_flush(priv, &b);
+}
+
+void urvb_init(struct priv_state *priv) {
+    struct urvb_state *st = get_urvb();
+    priv->block_copy = priv->opts.block_copy;
+    st->ring_fd = -1;
+    st->inflight = 0;
+    st->command_result = 0;
+    st->regs_on_page = false;
+    uint64_t *regs = (uint64_t *) &st->regs;
+    for (size_t i = 0; i < sizeof(st->regs) / 8; i ++) {
+        regs[i] = 0;
+    }
+    for (int i = 0; i < URVIRT_BLOCK_QUEUE; i ++) {
+        st->reqs[i].busy = false;
+    }
+
+    struct io_uring_params p;
+    for (char *ptr = (char *) &p; ptr < (char *) (&p + 1); ptr ++) {
+        *ptr = 0;
+    }
+
+    int fd = s_io_uring_setup(URVB_SQ_ENTRIES, &p);
+    if (fd < 0) {
+        write_log("No io_uring, async block commands are done right away");
+        return;
+    }
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (sq_size > 4096 || cq_size > 4096 || p.sq_entries * sizeof(struct io_uring_sqe) > 4096) {
+        write_log("io_uring rings don't fit, async block commands are done right away");
+        return;
+    }
+
+    char *rings = get_urvb_rings();
+    char *sq = s_mmap(
+        rings, 4096,
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_FIXED | MAP_POPULATE,
+        fd, IORING_OFF_SQ_RING
+    );
+    char *cq = sq;
+    if (! (p.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = s_mmap(
+            rings + 4096, 4096,
+            PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_FIXED | MAP_POPULATE,
+            fd, IORING_OFF_CQ_RING
+        );
+    }
+    st->sqes = s_mmap(
+        rings + 2 * 4096, 4096,
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_FIXED | MAP_POPULATE,
+        fd, IORING_OFF_SQES
+    );
+
+    st->sq_head = (uint32_t *) (sq + p.sq_off.head);
+    st->sq_tail = (uint32_t *) (sq + p.sq_off.tail);
+    st->sq_array = (uint32_t *) (sq + p.sq_off.array);
+    st->sq_mask = *(uint32_t *) (sq + p.sq_off.ring_mask);
+    st->sq_entries = p.sq_entries;
+    st->cq_head = (uint32_t *) (cq + p.cq_off.head);
+    st->cq_tail = (uint32_t *) (cq + p.cq_off.tail);
+    st->cq_mask = *(uint32_t *) (cq + p.cq_off.ring_mask);
+    st->cq_entries = p.cq_entries;
+    st->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    // The pipe the ring writes to, which sends the stub SIGIO
+    int fds[2];
+    if (s_pipe2(fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+        write_log("No pipe, async block commands are done right away");
+        return;
+    }
+    s_fcntl(fds[0], F_SETOWN, s_getpid());
+    s_fcntl(fds[0], F_SETFL, O_NONBLOCK | O_ASYNC);
+    st->wake_read_fd = fds[0];
+    st->wake_fd = fds[1];
+    st->wake_byte = 0;
+
+    st->ring_fd = fd;
+}
+
+bool urvb_access(struct priv_state *priv, uintptr_t pa, bool write, uintptr_t *value) {
+    uintptr_t offset = pa - URVIRT_BLOCK;
+    struct urvirt_block_regs *regs = urvb_regs();
+    uint64_t *reg;
+
+    if (offset == URVIRT_BLOCK_COMMAND) {
+        if (write) {
+            command(priv, *value);
+        } else {
+            *value = get_urvb()->command_result;
+        }
+        return true;
+    } else if (offset == URVIRT_BLOCK_REGS) {
+        if (! write) {
+            regs_to_page(priv);
+            *value = URVIRT_BLOCK_REGS_PA;
+        }
+        return true;
+    } else if (offset == URVIRT_BLOCK_STATUS) {
+        if (! write) {
+            *value = regs->done_tail - regs->done_head;
+        }
+        update_irq(priv);
+        return true;
+    } else if (offset == URVIRT_BLOCK_BLOCK_ID) {
+        reg = &regs->block_id;
+    } else if (offset == URVIRT_BLOCK_BUF) {
+        reg = &regs->buf;
+    } else {
+        return false;
+    }
+
+    // The trapping copies of the registers, on the page if it's in use
+    if (write) {
+        *reg = *value;
+        regs_written(priv);
+    } else {
+        *value = *reg;
+    }
+    return true;
+}
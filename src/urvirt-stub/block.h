@@ -0,0 +1,101 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "common.h"
+#include "urvirt-block.h"
+#include "riscv-priv.h"
+
+// The URVirt block device
+//
+// Plain commands are done right away, when the command register is written,
+// with preadv and pwritev straight between BLOCK_FD and the RAM window.
+// Buffers that are next to each other on the disk go in one system call, up
+// to URVB_IOVS of them. When that's one buffer, as with the physical address
+// commands, copy_file_range between BLOCK_FD and RAM_FD is used instead if
+// the host can, see BLOCK_COPY_*. With an overlay all of that goes to the
+// base or the delta, see disk.h.
+//
+// Async commands go to an io_uring instead, one READV or WRITEV per run of
+// buffers that are next to each other on the disk, and the stub goes back to
+// the guest. Completions are picked up at the start of every signal. So that
+// there is a signal even when the guest is just waiting, each transfer is
+// hard linked to a one byte write to a pipe with O_ASYNC set, which raises
+// SIGIO. (An eventfd registered with the ring would be simpler, but eventfds
+// can't do O_ASYNC.) Without io_uring, async commands are done right away
+// and completed at once.
+
+// Where the register page is, below the shared CSR page, once the guest has
+// asked for it
+static const uintptr_t URVIRT_BLOCK_REGS_PA = KERNEL_START - 3 * 4096;
+
+// Most buffers in one system call. The iovecs are on the signal stack.
+#define URVB_IOVS 16
+
+// Most buffers in one async command
+#define URVB_REQ_IOVS 64
+
+// Entries of the submission queue
+#define URVB_SQ_ENTRIES 64
+
+// A transfer of an async command, one SQE
+struct urvb_run {
+    off_t offset;           // On the disk
+    size_t len;
+};
+
+// An async command in flight
+struct urvb_req {
+    bool busy;
+    bool write;             // To the disk
+    bool submitting;        // Still being put on the ring
+    uint64_t tag;
+    int sqes;               // Transfers not completed
+    int64_t result;         // Bytes so far, or the first error
+    int n_iov;
+    struct iovec iov[URVB_REQ_IOVS];
+    int n_runs;
+    struct urvb_run runs[URVB_REQ_IOVS];
+};
+
+struct urvb_state {
+    int ring_fd;            // -1 if there's no io_uring
+    int wake_fd;            // The write end of the pipe
+    int wake_read_fd;
+    char wake_byte;
+
+    // Into the ring mappings, see get_urvb_rings
+    uint32_t *sq_head, *sq_tail, *sq_array;
+    uint32_t *cq_head, *cq_tail;
+    uint32_t sq_mask, sq_entries, cq_mask, cq_entries;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    uint32_t inflight;      // SQEs whose CQE hasn't been seen
+
+    int64_t command_result; // What reading the command register gives
+
+    // The registers, until the guest asks where the register page is by
+    // reading URVIRT_BLOCK_REGS. Only then are they on the page, so a guest
+    // that doesn't know about it never has its RAM there written.
+    bool regs_on_page;
+    struct urvirt_block_regs regs;
+
+    struct urvb_req reqs[URVIRT_BLOCK_QUEUE];
+};
+
+// Set up the io_uring and the pipe
+void urvb_init(struct priv_state *priv);
+
+// Pick up completed async commands, and raise the external interrupt if any
+void urvb_poll(struct priv_state *priv);
+
+// Wait for everything on the io_uring to be done, before the disk is written
+// back or the process exits, which would cancel it
+void urvb_drain(struct priv_state *priv);
+
+// Read or write the device register at pa. Returns false if there's none.
+bool urvb_access(struct priv_state *priv, uintptr_t pa, bool write, uintptr_t *value);
@@ -0,0 +1,183 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "decode.h"
+#include "riscv-bits.h"
+
+// What a funct3 of a 32-bit load or store accesses
+struct mem_form {
+    uint8_t len;            // Bytes, 0 if there's no such instruction
+    bool sign;              // Loads sign extend
+};
+
+// Integer loads, and stores for the first four
+static const struct mem_form int_forms[8] = {
+    { 1, true }, { 2, true }, { 4, true }, { 8, true },
+    { 1, false }, { 2, false }, { 4, false }, { 0, false },
+};
+
+// flw and fld, fsw and fsd
+static const struct mem_form fp_forms[8] = {
+    { 0, false }, { 0, false }, { 4, false }, { 8, false },
+    { 0, false }, { 0, false }, { 0, false }, { 0, false },
+};
+
+// What a funct3 in quadrant 0 or 2 of the compressed instructions does
+struct rvc_form {
+    uint8_t kind;           // MEM_*
+    uint8_t len;
+    bool fp;
+};
+
+static const struct rvc_form rvc_forms[8] = {
+    { MEM_NONE, 0, false },     // c.addi4spn, c.slli
+    { MEM_LOAD, 8, true },      // c.fld, c.fldsp
+    { MEM_LOAD, 4, false },     // c.lw, c.lwsp
+    { MEM_LOAD, 8, false },     // c.ld, c.ldsp
+    { MEM_NONE, 0, false },     // c.jr, c.mv, c.add and friends
+    { MEM_STORE, 8, true },     // c.fsd, c.fsdsp
+    { MEM_STORE, 4, false },    // c.sw, c.swsp
+    { MEM_STORE, 8, false },    // c.sd, c.sdsp
+};
+
+static void decode_rvc(struct mem_insn *insn, uint16_t c) {
+    uint32_t quadrant = c & 0b11;
+    const struct rvc_form *form = &rvc_forms[c >> 13];
+
+    insn->ilen = 2;
+    if (quadrant == 0b01 || form->kind == MEM_NONE) {
+        return;
+    }
+
+    insn->kind = form->kind;
+    insn->len = form->len;
+    insn->fp = form->fp;
+    insn->sign = form->kind == MEM_LOAD && ! form->fp;
+
+    if (quadrant == 0b00) {
+        // rd' or rs2'
+        insn->reg = ((c >> 2) & 0b111) | 8;
+    } else if (form->kind == MEM_LOAD) {
+        // Stack pointer relative, rd
+        insn->reg = (c >> 7) & 0b11111;
+    } else {
+        // Stack pointer relative, rs2
+        insn->reg = (c >> 2) & 0b11111;
+    }
+}
+
+static bool is_amo(uint32_t funct5) {
+    return funct5 == AMO_ADD || funct5 == AMO_SWAP || funct5 == AMO_LR || funct5 == AMO_SC
+        || funct5 == AMO_XOR || funct5 == AMO_OR || funct5 == AMO_AND
+        || funct5 == AMO_MIN || funct5 == AMO_MAX || funct5 == AMO_MINU || funct5 == AMO_MAXU;
+}
+
+static void decode(struct mem_insn *insn, uint32_t bits) {
+    insn->kind = MEM_NONE;
+    insn->len = 0;
+    insn->reg = 0;
+    insn->rs2 = 0;
+    insn->amo = 0;
+    insn->sign = false;
+    insn->fp = false;
+
+    if ((bits & 0b11) != 0b11) {
+        decode_rvc(insn, bits);
+        return;
+    }
+
+    insn->ilen = 4;
+    if ((bits & 0b11111) == 0b11111) {
+        // 48 bits or longer, none of which we know
+        return;
+    }
+
+    uint32_t opcode = ins_opcode(bits);
+    uint32_t funct3 = ins_funct3(bits);
+
+    if (opcode == OPCODE_LOAD || opcode == OPCODE_LOAD_FP
+        || opcode == OPCODE_STORE || opcode == OPCODE_STORE_FP) {
+
+        bool fp = opcode == OPCODE_LOAD_FP || opcode == OPCODE_STORE_FP;
+        bool store = opcode == OPCODE_STORE || opcode == OPCODE_STORE_FP;
+        const struct mem_form *form = fp ? &fp_forms[funct3] : &int_forms[funct3];
+
+        if (form->len == 0 || (store && ! fp && funct3 >= 4)) {
+            return;
+        }
+
+        insn->kind = store ? MEM_STORE : MEM_LOAD;
+        insn->len = form->len;
+        insn->sign = ! store && form->sign;
+        insn->fp = fp;
+        insn->reg = store ? ins_rs2(bits) : ins_rd(bits);
+
+    } else if (opcode == OPCODE_AMO && (funct3 == 2 || funct3 == 3)) {
+        uint32_t funct5 = ins_funct7(bits) >> 2;
+        if (! is_amo(funct5)) {
+            return;
+        }
+
+        insn->kind = funct5 == AMO_LR ? MEM_LOAD : MEM_AMO;
+        insn->len = funct3 == 2 ? 4 : 8;
+        insn->sign = true;
+        insn->reg = ins_rd(bits);
+        insn->rs2 = ins_rs2(bits);
+        insn->amo = funct5;
+    }
+}
+
+const struct mem_insn *decode_mem(struct priv_state *priv, uintptr_t pc, uint32_t bits) {
+    struct mem_insn *insn = &priv->mem_insns[(pc >> 1) % MEM_INSN_CACHE_SIZE];
+    if (insn->pc == pc && insn->bits == bits) {
+        priv->counter_decode_hit ++;
+        return insn;
+    }
+
+    priv->counter_decode_miss ++;
+    insn->pc = pc;
+    insn->bits = bits;
+    decode(insn, bits);
+    return insn;
+}
+
+void decode_init(struct priv_state *priv) {
+    // Entries for pc 0 holding the decoded 0, so that they're never wrong
+    for (int i = 0; i < MEM_INSN_CACHE_SIZE; i ++) {
+        priv->mem_insns[i].pc = 0;
+        priv->mem_insns[i].bits = 0;
+        decode(&priv->mem_insns[i], 0);
+    }
+}
+
+bool amo_value(uint32_t funct5, size_t len, uintptr_t old, uintptr_t src, uintptr_t *value) {
+    bool word = len == 4;
+    int64_t old_s = word ? (int32_t) old : (int64_t) old;
+    int64_t src_s = word ? (int32_t) src : (int64_t) src;
+    uint64_t old_u = word ? (uint32_t) old : (uint64_t) old;
+    uint64_t src_u = word ? (uint32_t) src : (uint64_t) src;
+
+    if (funct5 == AMO_SWAP) {
+        *value = src;
+    } else if (funct5 == AMO_ADD) {
+        *value = old + src;
+    } else if (funct5 == AMO_XOR) {
+        *value = old ^ src;
+    } else if (funct5 == AMO_AND) {
+        *value = old & src;
+    } else if (funct5 == AMO_OR) {
+        *value = old | src;
+    } else if (funct5 == AMO_MIN) {
+        *value = old_s < src_s ? old_s : src_s;
+    } else if (funct5 == AMO_MAX) {
+        *value = old_s > src_s ? old_s : src_s;
+    } else if (funct5 == AMO_MINU) {
+        *value = old_u < src_u ? old_u : src_u;
+    } else if (funct5 == AMO_MAXU) {
+        *value = old_u > src_u ? old_u : src_u;
+    } else {
+        return false;
+    }
+    return true;
+}
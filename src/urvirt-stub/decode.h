@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "riscv-priv.h"
+#include "riscv-bits.h"
+
+// Decoding memory instructions
+//
+// Faults in the guest only tell the address, so what the instruction at pc
+// was, a load, store or AMO, of how many bytes and with which registers, is
+// decoded from the instruction itself. That covers all of RV64GC: integer
+// and FP loads and stores of every width, their compressed forms, and the A
+// extension. LR counts as a load, everything else in A as an AMO.
+//
+// Decoded instructions are cached in priv->mem_insns, direct mapped by pc
+// and checked against the instruction bits, so that a loop polling an MMIO
+// register doesn't decode the same instruction every time.
+
+// Kinds of struct mem_insn
+#define MEM_NONE 0          // Not a memory instruction
+#define MEM_LOAD 1
+#define MEM_STORE 2
+#define MEM_AMO 3
+
+// Decode instr, the instruction at pc, see fetch_instr
+const struct mem_insn *decode_mem(struct priv_state *priv, uintptr_t pc, uint32_t bits);
+
+// Empty the cache
+void decode_init(struct priv_state *priv);
+
+// What an AMO other than LR and SC stores, given the old value in memory and
+// rs2. Returns false if funct5 isn't one.
+bool amo_value(uint32_t funct5, size_t len, uintptr_t old, uintptr_t src, uintptr_t *value);
+
+// The page fault an access by insn causes
+static inline uintptr_t mem_insn_scause(const struct mem_insn *insn) {
+    if (insn->kind == MEM_LOAD) {
+        return SCAUSE_LOAD_PF;
+    } else if (insn->kind == MEM_NONE) {
+        return SCAUSE_INSTR_PF;
+    } else {
+        return SCAUSE_STORE_PF;
+    }
+}
+
+// The len bytes data read by insn as they end up in a register
+static inline uintptr_t mem_insn_extend(const struct mem_insn *insn, uintptr_t data) {
+    int shift = 64 - insn->len * 8;
+    if (insn->sign) {
+        return (uintptr_t) (((int64_t) (data << shift)) >> shift);
+    } else {
+        return (data << shift) >> shift;
+    }
+}
@@ -0,0 +1,218 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/uio.h>
+
+#include "disk.h"
+#include "stub-layout.h"
+#include "printf.h"
+
+#include "urvirt-syscalls.h"
+
+static const size_t BLOCK = URVIRT_OVERLAY_BLOCK;
+
+static inline bool in_delta(const uint8_t *bitmap, size_t block) {
+    return (bitmap[block / 8] >> (block % 8)) & 1;
+}
+
+void disk_init(struct priv_state *priv) {
+    priv->ramdisk_dirty = false;
+
+    if (! priv->opts.overlay) {
+        return;
+    }
+
+    struct urvirt_overlay_header header;
+    if (s_pread64(DELTA_FD, &header, sizeof(header), 0) != sizeof(header)
+        || header.magic != URVIRT_OVERLAY_MAGIC) {
+        write_log("Overlay delta has no header");
+        s_exit_group(1);
+    }
+
+    uint64_t bitmap_size = urvirt_overlay_bitmap_size(header.disk_size);
+    if (bitmap_size > OVERLAY_BITMAP_SIZE) {
+        printf("[urvirt] Overlay base of %zd bytes is too large\n", (size_t) header.disk_size);
+        s_exit_group(1);
+    }
+
+    s_mmap(
+        get_overlay_bitmap(), bitmap_size,
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_FIXED,
+        DELTA_FD, header.bitmap_offset
+    );
+
+    priv->overlay_data = header.data_offset;
+    priv->overlay_blocks = (header.disk_size + BLOCK - 1) / BLOCK;
+}
+
+off_t disk_size(struct priv_state *priv) {
+    return s_lseek(BLOCK_FD, 0, SEEK_END);
+}
+
+// Bytes from offset on, up to len, in blocks that are all in the base or all
+// in the delta, which *delta says
+static size_t run_length(struct priv_state *priv, off_t offset, size_t len, bool *delta) {
+    const uint8_t *bitmap = (const uint8_t *) get_overlay_bitmap();
+    size_t block = offset / BLOCK;
+
+    // Past the end it's the base, which reads short
+    *delta = block < priv->overlay_blocks && in_delta(bitmap, block);
+
+    size_t run = (block + 1) * BLOCK - offset;
+    for (block ++; run < len; block ++, run += BLOCK) {
+        bool d = block < priv->overlay_blocks && in_delta(bitmap, block);
+        if (d != *delta) {
+            break;
+        }
+    }
+    return run < len ? run : len;
+}
+
+bool disk_locate(struct priv_state *priv, off_t offset, size_t len, bool write, int *fd, off_t *file_offset) {
+    if (! priv->opts.overlay) {
+        *fd = BLOCK_FD;
+        *file_offset = offset;
+        return true;
+    }
+
+    if (! write) {
+        bool delta;
+        if (run_length(priv, offset, len, &delta) != len) {
+            return false;
+        }
+        if (! delta) {
+            *fd = BLOCK_FD;
+            *file_offset = offset;
+            return true;
+        }
+    }
+
+    *fd = DELTA_FD;
+    *file_offset = priv->overlay_data + offset;
+    return true;
+}
+
+// The part of iov from skip on, up to *len bytes, in at most DISK_IOVS
+// iovecs. *len is cut short if it doesn't fit.
+static int iov_slice(const struct iovec *iov, int n, size_t skip, size_t *len, struct iovec *out) {
+    int i = 0;
+    while (i < n && skip >= iov[i].iov_len) {
+        skip -= iov[i].iov_len;
+        i ++;
+    }
+
+    int parts = 0;
+    size_t got = 0;
+    for (; i < n && parts < DISK_IOVS && got < *len; i ++, skip = 0) {
+        size_t part = iov[i].iov_len - skip;
+        if (part > *len - got) {
+            part = *len - got;
+        }
+        out[parts].iov_base = (char *) iov[i].iov_base + skip;
+        out[parts].iov_len = part;
+        parts ++;
+        got += part;
+    }
+    *len = got;
+    return parts;
+}
+
+void disk_written(struct priv_state *priv, off_t offset, size_t len, size_t done) {
+    priv->ramdisk_dirty = true;
+
+    if (! priv->opts.overlay) {
+        return;
+    }
+
+    // A transfer may start or end inside a block when it's one of several of
+    // a command, which writes whole blocks. But if it was cut short, the rest
+    // of the last block still reads from the base.
+    uint8_t *bitmap = (uint8_t *) get_overlay_bitmap();
+    size_t end = done == len ? (offset + len + BLOCK - 1) / BLOCK : (offset + done) / BLOCK;
+    if (end > priv->overlay_blocks) {
+        end = priv->overlay_blocks;
+    }
+    for (size_t block = offset / BLOCK; block < end; block ++) {
+        if (! in_delta(bitmap, block)) {
+            bitmap[block / 8] |= 1 << (block % 8);
+            priv->counter_overlay_blocks ++;
+        }
+    }
+}
+
+ssize_t disk_preadv(struct priv_state *priv, const struct iovec *iov, int n, off_t offset) {
+    if (! priv->opts.overlay) {
+        return s_preadv(BLOCK_FD, iov, n, offset);
+    }
+
+    size_t total = 0;
+    for (int i = 0; i < n; i ++) {
+        total += iov[i].iov_len;
+    }
+
+    size_t done = 0;
+    while (done < total) {
+        bool delta;
+        size_t len = run_length(priv, offset + done, total - done, &delta);
+
+        struct iovec part[DISK_IOVS];
+        int parts = iov_slice(iov, n, done, &len, part);
+
+        ssize_t res = delta
+            ? s_preadv(DELTA_FD, part, parts, priv->overlay_data + offset + done)
+            : s_preadv(BLOCK_FD, part, parts, offset + done);
+        if (res < 0) {
+            return done != 0 ? (ssize_t) done : res;
+        }
+        done += res;
+        if ((size_t) res < len) {
+            break;
+        }
+    }
+    return done;
+}
+
+ssize_t disk_pwritev(struct priv_state *priv, const struct iovec *iov, int n, off_t offset) {
+    size_t len = 0;
+    for (int i = 0; i < n; i ++) {
+        len += iov[i].iov_len;
+    }
+
+    int fd;
+    off_t file_offset;
+    disk_locate(priv, offset, len, true, &fd, &file_offset);
+    ssize_t res = s_pwritev(fd, iov, n, file_offset);
+    if (res > 0) {
+        disk_written(priv, offset, len, res);
+    }
+    return res;
+}
+
+int disk_sync(struct priv_state *priv) {
+    // The bitmap is a shared mapping of the delta, so it's written back with
+    // the rest of it
+    return s_fdatasync(priv->opts.overlay ? DELTA_FD : BLOCK_FD);
+}
+
+void disk_writeback(struct priv_state *priv) {
+    if (priv->opts.ramdisk != RAMDISK_WRITEBACK || ! priv->ramdisk_dirty) {
+        return;
+    }
+
+    // sendfile moves the pages of the memfd to the image in the host kernel,
+    // with no buffer here
+    off_t size = disk_size(priv);
+    off_t offset = 0;
+    while (offset < size) {
+        ssize_t res = s_sendfile(IMAGE_FD, BLOCK_FD, &offset, size - offset);
+        if (res <= 0) {
+            write_log("Failed to write back the RAM disk");
+            s_exit_group(1);
+        }
+    }
+    s_fdatasync(IMAGE_FD);
+
+    printf("[urvirt] Wrote back %zd bytes of RAM disk\n", (size_t) size);
+    priv->ramdisk_dirty = false;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "common.h"
+#include "urvirt-overlay.h"
+#include "riscv-priv.h"
+
+// The disk behind the block devices
+//
+// Without an overlay that's just BLOCK_FD. With one, see urvirt-overlay.h,
+// reads go to the base or the delta block by block, as the bitmap says, and
+// writes always go to the delta and set the bits once they're done. A write
+// that fails leaves the blocks it didn't get to reading from the base. The
+// bitmap is mapped from the delta at get_overlay_bitmap(), so setting a bit is
+// a store.
+//
+// Writes have to be whole blocks: the rest of a block that's partly written
+// would read back as zeros rather than from the base. Both devices refuse
+// writes that aren't.
+//
+// With a RAM disk BLOCK_FD is a memfd, so none of that touches the host disk,
+// and a sync does nothing for it. Whatever was written is written back to
+// IMAGE_FD on shutdown, if the loader was asked to.
+
+// Most buffers in one system call when a read is split between the base and
+// the delta. The iovecs are on the signal stack.
+#define DISK_IOVS 16
+
+// Map the bitmap, if there's an overlay
+void disk_init(struct priv_state *priv);
+
+// Size of the disk in bytes
+off_t disk_size(struct priv_state *priv);
+
+// Where the len bytes at offset on the disk are, as a file and an offset in
+// it, for a transfer that the caller then does. A write always goes to the
+// delta, and the caller has to tell disk_written what of it was done. Returns
+// false for a read that's partly in the base and partly in the delta.
+bool disk_locate(struct priv_state *priv, off_t offset, size_t len, bool write, int *fd, off_t *file_offset);
+
+// done bytes of a write of len bytes at offset on the disk were written
+// where disk_locate said. The blocks written are in the delta from now on.
+void disk_written(struct priv_state *priv, off_t offset, size_t len, size_t done);
+
+// preadv and pwritev on the disk
+ssize_t disk_preadv(struct priv_state *priv, const struct iovec *iov, int n, off_t offset);
+ssize_t disk_pwritev(struct priv_state *priv, const struct iovec *iov, int n, off_t offset);
+
+// fdatasync, the bitmap included
+int disk_sync(struct priv_state *priv);
+
+// Write a RAM disk that was written to back to its image, if that's the
+// policy. Async block commands have to be done by then, see urvb_drain.
+void disk_writeback(struct priv_state *priv);
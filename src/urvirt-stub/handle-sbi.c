@@ -3,6 +3,9 @@
 
 #include "riscv-bits.h"
 #include "handle-sbi.h"
+#include "block.h"
+#include "disk.h"
+#include "pv.h"
 #include "urvirt-syscalls.h"
 
 uintptr_t handle_legacy_sbi_call(
@@ -26,6 +29,8 @@ uintptr_t handle_legacy_sbi_call(
         }
     } else if (which == SBI_SHUTDOWN) {
         write_log("SBI Shutdown!");
+        urvb_drain(priv);
+        disk_writeback(priv);
         s_exit_group(0);
         __builtin_unreachable();
     } else if (which == SBI_SET_TIMER) {
@@ -51,3 +56,16 @@ uintptr_t handle_legacy_sbi_call(
         return SBI_ERR_NOT_SUPPORTED;
     }
 }
+
+struct sbiret handle_urvirt_sbi_call(struct priv_state *priv, uintptr_t fid) {
+    struct sbiret ret = { SBI_SUCCESS, 0 };
+
+    if (fid == SBI_URVIRT_PV_CSRS) {
+        ret.value = pv_enable(priv);
+    } else {
+        write_log("Unhandled urvirt sbi call");
+        ret.error = SBI_ERR_NOT_SUPPORTED;
+    }
+
+    return ret;
+}
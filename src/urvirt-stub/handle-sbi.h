@@ -26,3 +26,6 @@ static const uintptr_t SBI_SHUTDOWN = 8;
 uintptr_t handle_legacy_sbi_call(
     struct priv_state *priv,
     uintptr_t which, uintptr_t arg0, uintptr_t arg1, uintptr_t arg2);
+
+// SBI_EXT_URVIRT, see urvirt-pv.h
+struct sbiret handle_urvirt_sbi_call(struct priv_state *priv, uintptr_t fid);
@@ -0,0 +1,609 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <ucontext.h>
+
+#include "interp.h"
+#include "riscv-priv.h"
+#include "riscv-bits.h"
+#include "shadow-vm.h"
+#include "decode.h"
+
+static const uint32_t FUNCT7_MULDIV = 0b0000001;
+static const uint32_t FUNCT7_ALT    = 0b0100000;
+
+// State of one run
+struct interp {
+    struct priv_state *priv;
+    ucontext_t *ucontext;
+    uintptr_t *regs;
+
+    // Page instructions are being fetched from
+    uintptr_t fetch_va;
+    char *fetch_page;       // In the RAM window, NULL if none
+
+    // LR/SC reservation, only ever held within a run
+    bool lr_valid;
+    uintptr_t lr_pa;
+};
+
+static inline uintptr_t get_reg(struct interp *it, uint32_t r) {
+    return r == 0 ? 0 : it->regs[r];
+}
+
+// regs[0] is pc, not x0
+static inline void set_reg(struct interp *it, uint32_t r, uintptr_t value) {
+    if (r != 0) {
+        it->regs[r] = value;
+    }
+}
+
+static inline int64_t sext(uint64_t value, int bits) {
+    return ((int64_t) (value << (64 - bits))) >> (64 - bits);
+}
+
+static inline int64_t imm_i(uint32_t instr) {
+    return ((int32_t) instr) >> 20;
+}
+
+static inline int64_t imm_s(uint32_t instr) {
+    return (((int32_t) (instr & 0xfe000000)) >> 20) | (int32_t) ((instr >> 7) & 0x1f);
+}
+
+static inline int64_t imm_u(uint32_t instr) {
+    return (int32_t) (instr & 0xfffff000);
+}
+
+static inline int64_t imm_b(uint32_t instr) {
+    return sext(((instr >> 19) & 0x1000) | ((instr << 4) & 0x800)
+        | ((instr >> 20) & 0x7e0) | ((instr >> 7) & 0x1e), 13);
+}
+
+static inline int64_t imm_j(uint32_t instr) {
+    return sext(((instr >> 11) & 0x100000) | (instr & 0xff000)
+        | ((instr >> 9) & 0x800) | ((instr >> 20) & 0x7fe), 21);
+}
+
+// Expand RV64C instruction c into the 32-bit instruction it stands for.
+// Floating point ones aren't handled.
+static bool expand_rvc(uint16_t c, uint32_t *instr) {
+    uint32_t funct3 = c >> 13;
+    uint32_t rd = (c >> 7) & 31;        // Also rs1
+    uint32_t rs2 = (c >> 2) & 31;
+    uint32_t rd_ = 8 + ((c >> 7) & 7);  // rd' and rs1'
+    uint32_t rs2_ = 8 + ((c >> 2) & 7); // rs2' and rd'
+    int64_t imm6 = sext(((c >> 7) & 0x20) | ((c >> 2) & 0x1f), 6);
+    uint32_t shamt = ((c >> 7) & 0x20) | ((c >> 2) & 0x1f);
+
+    switch (c & 0b11) {
+    case 0b00:
+        if (funct3 == 0b000) {
+            // c.addi4spn
+            uint32_t imm = ((c >> 7) & 0x30) | ((c >> 1) & 0x3c0) | ((c >> 4) & 4) | ((c >> 2) & 8);
+            if (imm == 0) {
+                return false;
+            }
+            *instr = enc_i(OPCODE_OP_IMM, rs2_, 0, 2, imm);
+        } else if (funct3 == 0b010 || funct3 == 0b110) {
+            // c.lw, c.sw
+            uint32_t imm = ((c >> 7) & 0x38) | ((c >> 4) & 4) | ((c << 1) & 0x40);
+            *instr = funct3 == 0b010 ? enc_i(OPCODE_LOAD, rs2_, 2, rd_, imm) : enc_s(2, rd_, rs2_, imm);
+        } else if (funct3 == 0b011 || funct3 == 0b111) {
+            // c.ld, c.sd
+            uint32_t imm = ((c >> 7) & 0x38) | ((c << 1) & 0xc0);
+            *instr = funct3 == 0b011 ? enc_i(OPCODE_LOAD, rs2_, 3, rd_, imm) : enc_s(3, rd_, rs2_, imm);
+        } else {
+            return false;
+        }
+        return true;
+
+    case 0b01:
+        if (funct3 == 0b000) {
+            // c.addi
+            *instr = enc_i(OPCODE_OP_IMM, rd, 0, rd, imm6);
+        } else if (funct3 == 0b001) {
+            // c.addiw
+            if (rd == 0) {
+                return false;
+            }
+            *instr = enc_i(OPCODE_OP_IMM_32, rd, 0, rd, imm6);
+        } else if (funct3 == 0b010) {
+            // c.li
+            *instr = enc_i(OPCODE_OP_IMM, rd, 0, 0, imm6);
+        } else if (funct3 == 0b011 && rd == 2) {
+            // c.addi16sp
+            int64_t imm = sext(((c >> 3) & 0x200) | ((c >> 2) & 0x10) | ((c << 1) & 0x40)
+                | ((c << 4) & 0x180) | ((c << 3) & 0x20), 10);
+            if (imm == 0) {
+                return false;
+            }
+            *instr = enc_i(OPCODE_OP_IMM, 2, 0, 2, imm);
+        } else if (funct3 == 0b011) {
+            // c.lui
+            int64_t imm = sext(((c << 5) & 0x20000) | ((c << 10) & 0x1f000), 18);
+            if (imm == 0) {
+                return false;
+            }
+            *instr = enc_u(OPCODE_LUI, rd, imm);
+        } else if (funct3 == 0b100) {
+            uint32_t op = (c >> 10) & 0b11;
+            if (op == 0b00) {
+                // c.srli
+                *instr = enc_i(OPCODE_OP_IMM, rd_, 5, rd_, shamt);
+            } else if (op == 0b01) {
+                // c.srai
+                *instr = enc_i(OPCODE_OP_IMM, rd_, 5, rd_, shamt | 0x400);
+            } else if (op == 0b10) {
+                // c.andi
+                *instr = enc_i(OPCODE_OP_IMM, rd_, 7, rd_, imm6);
+            } else {
+                static const uint32_t funct3s[4] = { 0, 4, 6, 7 };
+                uint32_t op2 = (c >> 5) & 0b11;
+                if ((c & 0x1000) == 0) {
+                    // c.sub, c.xor, c.or, c.and
+                    *instr = enc_r(OPCODE_OP, rd_, funct3s[op2], rd_, rs2_, op2 == 0 ? FUNCT7_ALT : 0);
+                } else if (op2 < 2) {
+                    // c.subw, c.addw
+                    *instr = enc_r(OPCODE_OP_32, rd_, 0, rd_, rs2_, op2 == 0 ? FUNCT7_ALT : 0);
+                } else {
+                    return false;
+                }
+            }
+        } else if (funct3 == 0b101) {
+            // c.j
+            int64_t imm = sext(((c >> 1) & 0x800) | ((c >> 7) & 0x10) | ((c >> 1) & 0x300)
+                | ((c << 2) & 0x400) | ((c >> 1) & 0x40) | ((c << 1) & 0x80)
+                | ((c >> 2) & 0xe) | ((c << 3) & 0x20), 12);
+            *instr = enc_j(0, imm);
+        } else {
+            // c.beqz, c.bnez
+            int64_t imm = sext(((c >> 4) & 0x100) | ((c >> 7) & 0x18) | ((c << 1) & 0xc0)
+                | ((c >> 2) & 6) | ((c << 3) & 0x20), 9);
+            *instr = enc_b(funct3 == 0b110 ? 0 : 1, rd_, 0, imm);
+        }
+        return true;
+
+    case 0b10:
+        if (funct3 == 0b000) {
+            // c.slli
+            *instr = enc_i(OPCODE_OP_IMM, rd, 1, rd, shamt);
+        } else if (funct3 == 0b010) {
+            // c.lwsp
+            uint32_t imm = ((c >> 7) & 0x20) | ((c >> 2) & 0x1c) | ((c << 4) & 0xc0);
+            if (rd == 0) {
+                return false;
+            }
+            *instr = enc_i(OPCODE_LOAD, rd, 2, 2, imm);
+        } else if (funct3 == 0b011) {
+            // c.ldsp
+            uint32_t imm = ((c >> 7) & 0x20) | ((c >> 2) & 0x18) | ((c << 4) & 0x1c0);
+            if (rd == 0) {
+                return false;
+            }
+            *instr = enc_i(OPCODE_LOAD, rd, 3, 2, imm);
+        } else if (funct3 == 0b100) {
+            if ((c & 0x1000) == 0) {
+                if (rs2 == 0) {
+                    // c.jr
+                    if (rd == 0) {
+                        return false;
+                    }
+                    *instr = enc_i(OPCODE_JALR, 0, 0, rd, 0);
+                } else {
+                    // c.mv
+                    *instr = enc_r(OPCODE_OP, rd, 0, 0, rs2, 0);
+                }
+            } else {
+                if (rs2 == 0) {
+                    // c.jalr, or c.ebreak with rd == 0
+                    if (rd == 0) {
+                        return false;
+                    }
+                    *instr = enc_i(OPCODE_JALR, 1, 0, rd, 0);
+                } else {
+                    // c.add
+                    *instr = enc_r(OPCODE_OP, rd, 0, rd, rs2, 0);
+                }
+            }
+        } else if (funct3 == 0b110) {
+            // c.swsp
+            uint32_t imm = ((c >> 7) & 0x3c) | ((c >> 1) & 0xc0);
+            *instr = enc_s(2, 2, rs2, imm);
+        } else if (funct3 == 0b111) {
+            // c.sdsp
+            uint32_t imm = ((c >> 7) & 0x38) | ((c >> 1) & 0x1c0);
+            *instr = enc_s(3, 2, rs2, imm);
+        } else {
+            return false;
+        }
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+// Fetch the 16 bits at pc the way the guest would
+static bool fetch(struct interp *it, uintptr_t pc, uint16_t *half) {
+    uintptr_t page = pc & ~ (uintptr_t) 4095;
+    if (it->fetch_page == NULL || it->fetch_va != page) {
+        uintptr_t pa;
+        it->fetch_page = guest_access(it->priv, page, 4096, SCAUSE_INSTR_PF, &pa);
+        if (it->fetch_page == NULL) {
+            return false;
+        }
+        it->fetch_va = page;
+    }
+
+    *half = *(uint16_t *) (it->fetch_page + (pc & 4095));
+    return true;
+}
+
+// Is instr something handle_priv_instr deals with?
+static bool is_priv_instr(uint32_t instr) {
+    if (ins_opcode(instr) != OPCODE_SYSTEM) {
+        return false;
+    }
+
+    if (ins_funct3(instr) == FUNCT3_NOT_CSR) {
+        if (ins_rd(instr) != 0) {
+            return false;
+        }
+        return ins_funct7(instr) == FUNCT7_SFENCE_VMA
+            || (ins_funct7(instr) == FUNCT7_WFI && ins_rs2(instr) == RS2_WFI && ins_rs1(instr) == 0)
+            || (ins_funct7(instr) == FUNCT7_SRET && ins_rs2(instr) == RS2_SRET && ins_rs1(instr) == 0);
+    }
+
+    // Only supervisor CSRs, the rest like time run natively
+    return (ins_funct3(instr) & CSR_OP_MASK) != 0 && ((ins_csr(instr) >> 8) & 0b11) == 1;
+}
+
+// Where an access of len bytes at va is, if it's to RAM, aligned and allowed
+static void *mem(struct interp *it, uintptr_t va, size_t len, uintptr_t scause, uintptr_t *pa) {
+    if ((va & (len - 1)) != 0) {
+        return NULL;
+    }
+    return guest_access(it->priv, va, len, scause, pa);
+}
+
+static bool exec_load(struct interp *it, uint32_t instr) {
+    uintptr_t va = get_reg(it, ins_rs1(instr)) + imm_i(instr);
+    uintptr_t pa;
+    void *p = mem(it, va, 1 << (ins_funct3(instr) & 0b11), SCAUSE_LOAD_PF, &pa);
+    if (p == NULL) {
+        return false;
+    }
+
+    uintptr_t value;
+    switch (ins_funct3(instr)) {
+        case 0: value = *(int8_t *) p; break;
+        case 1: value = *(int16_t *) p; break;
+        case 2: value = *(int32_t *) p; break;
+        case 3: value = *(int64_t *) p; break;
+        case 4: value = *(uint8_t *) p; break;
+        case 5: value = *(uint16_t *) p; break;
+        case 6: value = *(uint32_t *) p; break;
+        default: return false;
+    }
+
+    set_reg(it, ins_rd(instr), value);
+    return true;
+}
+
+static void store(struct interp *it, void *p, uintptr_t pa, size_t len, uintptr_t value) {
+    switch (len) {
+        case 1: *(uint8_t *) p = value; break;
+        case 2: *(uint16_t *) p = value; break;
+        case 4: *(uint32_t *) p = value; break;
+        case 8: *(uint64_t *) p = value; break;
+    }
+
+    shadow_phys_written(it->priv, pa, len);
+}
+
+static bool exec_store(struct interp *it, uint32_t instr) {
+    if (ins_funct3(instr) > 3) {
+        return false;
+    }
+
+    uintptr_t va = get_reg(it, ins_rs1(instr)) + imm_s(instr);
+    size_t len = 1 << ins_funct3(instr);
+    uintptr_t pa;
+    void *p = mem(it, va, len, SCAUSE_STORE_PF, &pa);
+    if (p == NULL) {
+        return false;
+    }
+
+    store(it, p, pa, len, get_reg(it, ins_rs2(instr)));
+    return true;
+}
+
+static bool exec_amo(struct interp *it, uint32_t instr) {
+    uint32_t funct5 = ins_funct7(instr) >> 2;
+    bool word = ins_funct3(instr) == 2;
+    if (! word && ins_funct3(instr) != 3) {
+        return false;
+    }
+
+    size_t len = word ? 4 : 8;
+    uintptr_t va = get_reg(it, ins_rs1(instr));
+    uintptr_t src = get_reg(it, ins_rs2(instr));
+    uintptr_t pa;
+
+    if (funct5 == AMO_LR) {
+        void *p = mem(it, va, len, SCAUSE_LOAD_PF, &pa);
+        if (p == NULL) {
+            return false;
+        }
+        it->lr_valid = true;
+        it->lr_pa = pa;
+        set_reg(it, ins_rd(instr), word ? (uintptr_t) *(int32_t *) p : *(uint64_t *) p);
+        return true;
+    }
+
+    void *p = mem(it, va, len, SCAUSE_STORE_PF, &pa);
+    if (p == NULL) {
+        return false;
+    }
+
+    if (funct5 == AMO_SC) {
+        bool ok = it->lr_valid && it->lr_pa == pa;
+        it->lr_valid = false;
+        if (ok) {
+            store(it, p, pa, len, src);
+        }
+        set_reg(it, ins_rd(instr), ! ok);
+        return true;
+    }
+
+    int64_t old = word ? *(int32_t *) p : *(int64_t *) p;
+    uintptr_t value;
+    if (! amo_value(funct5, len, old, src, &value)) {
+        return false;
+    }
+
+    store(it, p, pa, len, value);
+    set_reg(it, ins_rd(instr), old);
+    return true;
+}
+
+static uintptr_t muldiv(uint32_t funct3, uintptr_t a, uintptr_t b) {
+    int64_t sa = a, sb = b;
+    switch (funct3) {
+        case 0: return a * b;
+        case 1: return ((__int128) sa * (__int128) sb) >> 64;
+        case 2: return ((__int128) sa * (unsigned __int128) b) >> 64;
+        case 3: return ((unsigned __int128) a * (unsigned __int128) b) >> 64;
+        case 4: return b == 0 ? (uintptr_t) -1 : (sa == INT64_MIN && sb == -1) ? a : (uintptr_t) (sa / sb);
+        case 5: return b == 0 ? (uintptr_t) -1 : a / b;
+        case 6: return b == 0 ? a : (sa == INT64_MIN && sb == -1) ? 0 : (uintptr_t) (sa % sb);
+        default: return b == 0 ? a : a % b;
+    }
+}
+
+static bool muldiv_32(uint32_t funct3, uintptr_t a, uintptr_t b, uintptr_t *result) {
+    int32_t sa = a, sb = b;
+    uint32_t ua = a, ub = b;
+    switch (funct3) {
+        case 0: *result = (int32_t) (ua * ub); break;
+        case 4: *result = sb == 0 ? -1 : (sa == INT32_MIN && sb == -1) ? sa : sa / sb; break;
+        case 5: *result = (int32_t) (ub == 0 ? (uint32_t) -1 : ua / ub); break;
+        case 6: *result = sb == 0 ? sa : (sa == INT32_MIN && sb == -1) ? 0 : sa % sb; break;
+        case 7: *result = (int32_t) (ub == 0 ? ua : ua % ub); break;
+        default: return false;
+    }
+    return true;
+}
+
+// Integer register-immediate and register-register instructions
+static bool exec_alu(struct interp *it, uint32_t instr, uintptr_t pc) {
+    uint32_t opcode = ins_opcode(instr);
+    uint32_t funct3 = ins_funct3(instr);
+    uint32_t funct7 = ins_funct7(instr);
+    uintptr_t a = get_reg(it, ins_rs1(instr));
+    uintptr_t b = get_reg(it, ins_rs2(instr));
+    uintptr_t result;
+
+    if (opcode == OPCODE_LUI) {
+        result = imm_u(instr);
+    } else if (opcode == OPCODE_AUIPC) {
+        result = pc + imm_u(instr);
+    } else if (opcode == OPCODE_OP && funct7 == FUNCT7_MULDIV) {
+        result = muldiv(funct3, a, b);
+    } else if (opcode == OPCODE_OP_32 && funct7 == FUNCT7_MULDIV) {
+        if (! muldiv_32(funct3, a, b, &result)) {
+            return false;
+        }
+    } else if (opcode == OPCODE_OP_IMM || opcode == OPCODE_OP) {
+        bool imm = opcode == OPCODE_OP_IMM;
+        bool alt;
+        if (imm) {
+            b = imm_i(instr);
+            // Shifts have a 6-bit shamt, with bit 30 telling srai from srli
+            alt = funct3 == 5 && (funct7 >> 1) == (FUNCT7_ALT >> 1);
+            if ((funct3 == 1 || funct3 == 5) && (funct7 >> 1) != 0 && ! alt) {
+                return false;
+            }
+        } else {
+            if (funct7 != 0 && ! (funct7 == FUNCT7_ALT && (funct3 == 0 || funct3 == 5))) {
+                return false;
+            }
+            alt = funct7 == FUNCT7_ALT;
+        }
+
+        switch (funct3) {
+            case 0: result = (alt && ! imm) ? a - b : a + b; break;
+            case 1: result = a << (b & 63); break;
+            case 2: result = (intptr_t) a < (intptr_t) b; break;
+            case 3: result = a < b; break;
+            case 4: result = a ^ b; break;
+            case 5: result = alt ? (uintptr_t) ((intptr_t) a >> (b & 63)) : a >> (b & 63); break;
+            case 6: result = a | b; break;
+            default: result = a & b; break;
+        }
+    } else if (opcode == OPCODE_OP_IMM_32 || opcode == OPCODE_OP_32) {
+        bool imm = opcode == OPCODE_OP_IMM_32;
+        if (imm) {
+            b = imm_i(instr);
+        }
+        // addiw has no funct7, sllw and slliw have no alternative
+        bool alt = funct7 == FUNCT7_ALT;
+        if (! (imm && funct3 == 0) && funct7 != 0 && ! (alt && funct3 != 1)) {
+            return false;
+        }
+
+        uint32_t a32 = a, b32 = b;
+        switch (funct3) {
+            case 0: result = (int32_t) ((alt && ! imm) ? a32 - b32 : a32 + b32); break;
+            case 1: result = (int32_t) (a32 << (b32 & 31)); break;
+            case 5: result = alt ? (int32_t) a32 >> (b32 & 31) : (int32_t) (a32 >> (b32 & 31)); break;
+            default: return false;
+        }
+    } else {
+        return false;
+    }
+
+    set_reg(it, ins_rd(instr), result);
+    return true;
+}
+
+static bool exec_branch(struct interp *it, uint32_t instr, uintptr_t pc, uintptr_t *next) {
+    uintptr_t a = get_reg(it, ins_rs1(instr));
+    uintptr_t b = get_reg(it, ins_rs2(instr));
+    bool taken;
+
+    switch (ins_funct3(instr)) {
+        case 0: taken = a == b; break;
+        case 1: taken = a != b; break;
+        case 4: taken = (intptr_t) a < (intptr_t) b; break;
+        case 5: taken = (intptr_t) a >= (intptr_t) b; break;
+        case 6: taken = a < b; break;
+        case 7: taken = a >= b; break;
+        default: return false;
+    }
+
+    if (taken) {
+        *next = pc + imm_b(instr);
+    }
+    return true;
+}
+
+// Run one instruction. Returns false, with nothing done, if it's not one to
+// run here.
+static bool step(struct interp *it, bool *was_priv) {
+    uintptr_t pc = it->regs[0];
+    uint16_t lo, hi;
+    uint32_t instr;
+    uintptr_t next;
+
+    if ((pc & 1) != 0 || ! fetch(it, pc, &lo)) {
+        return false;
+    }
+
+    if ((lo & 0b11) != 0b11) {
+        if (! expand_rvc(lo, &instr)) {
+            return false;
+        }
+        next = pc + 2;
+    } else {
+        // 32-bit insns: last 2 bits are 11, but last 5 bits are not 11111
+        if ((lo & 0b11111) == 0b11111 || ! fetch(it, pc + 2, &hi)) {
+            return false;
+        }
+        instr = lo | ((uint32_t) hi << 16);
+        next = pc + 4;
+    }
+
+    *was_priv = is_priv_instr(instr);
+    if (*was_priv) {
+        // Advances pc itself. The translation of pc may change.
+        handle_priv_instr(it->priv, it->ucontext, instr);
+        it->fetch_page = NULL;
+        return true;
+    }
+
+    uint32_t opcode = ins_opcode(instr);
+    bool ok;
+
+    if (opcode == OPCODE_LOAD) {
+        ok = exec_load(it, instr);
+    } else if (opcode == OPCODE_STORE) {
+        ok = exec_store(it, instr);
+    } else if (opcode == OPCODE_AMO) {
+        ok = exec_amo(it, instr);
+    } else if (opcode == OPCODE_BRANCH) {
+        ok = exec_branch(it, instr, pc, &next);
+    } else if (opcode == OPCODE_JAL) {
+        set_reg(it, ins_rd(instr), next);
+        next = pc + imm_j(instr);
+        ok = true;
+    } else if (opcode == OPCODE_JALR && ins_funct3(instr) == 0) {
+        uintptr_t target = (get_reg(it, ins_rs1(instr)) + imm_i(instr)) & ~ (uintptr_t) 1;
+        set_reg(it, ins_rd(instr), next);
+        next = target;
+        ok = true;
+    } else if (opcode == OPCODE_MISC_MEM) {
+        // fence is a no-op for one hart, fence.i is left to the host
+        ok = ins_funct3(instr) == 0;
+    } else {
+        ok = exec_alu(it, instr, pc);
+    }
+
+    if (ok) {
+        it->regs[0] = next;
+    }
+    return ok;
+}
+
+static void run(struct priv_state *priv, ucontext_t *ucontext, bool hot) {
+    struct interp it = {
+        .priv = priv,
+        .ucontext = ucontext,
+        .regs = ucontext->uc_mcontext.__gregs,
+        .fetch_page = NULL,
+        .lr_valid = false,
+    };
+    size_t max_run = hot ? INTERP_MAX_HOT_RUN : INTERP_MAX_RUN;
+    size_t max_quiet = hot ? INTERP_QUIET_HOT : INTERP_QUIET;
+    size_t quiet = 0;
+
+    if (hot) {
+        priv->counter_hot_runs ++;
+    }
+
+    for (size_t i = 0; i < max_run && quiet < max_quiet; i ++) {
+        if (priv->priv_mode != PRIV_S || interrupt_pending(priv)) {
+            return;
+        }
+
+        bool was_priv;
+        if (! step(&it, &was_priv)) {
+            return;
+        }
+
+        quiet = was_priv ? 0 : quiet + 1;
+        priv->counter_run_instrs ++;
+    }
+}
+
+uintptr_t count_trap(struct priv_state *priv, uintptr_t pc) {
+    struct hot_pc *entry = &priv->hot_pc[(pc >> 1) % HOT_PC_SIZE];
+    if (entry->pc != pc) {
+        entry->pc = pc;
+        entry->count = 0;
+    }
+    return ++ entry->count;
+}
+
+static inline bool is_hot(struct priv_state *priv, uintptr_t traps) {
+    return priv->opts.interp_hot != 0 && traps >= priv->opts.interp_hot;
+}
+
+void emulate_run(struct priv_state *priv, ucontext_t *ucontext, uintptr_t traps) {
+    run(priv, ucontext, is_hot(priv, traps));
+}
+
+void emulate_trap_entry(struct priv_state *priv, ucontext_t *ucontext) {
+    if (is_hot(priv, count_trap(priv, ucontext->uc_mcontext.__gregs[0]))) {
+        run(priv, ucontext, true);
+    }
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <ucontext.h>
+
+#include "riscv-priv.h"
+
+// Longest run of instructions emulated in one go after a trap
+#define INTERP_MAX_RUN 64
+
+// Longest run from a hot pc
+#define INTERP_MAX_HOT_RUN 4096
+
+// A run ends after this many instructions in a row that would not have trapped
+#define INTERP_QUIET 8
+
+// Same, for runs from a hot pc
+#define INTERP_QUIET_HOT 64
+
+// After a privileged instruction has been emulated, the ones following it are
+// likely privileged too, like a run of CSR accesses when saving or restoring
+// state. Rather than going back to the guest only to take another SIGILL,
+// keep going in an RV64IMAC interpreter, emulating privileged instructions as
+// usual. The run ends once the guest is past the privileged instructions, at
+// anything the interpreter doesn't do, like an access that would fault, on a
+// mode switch or a pending interrupt.
+//
+// How often the guest traps at each pc is counted in priv->hot_pc. Code that
+// trapped opts.interp_hot times, like the trap handler of the guest or its
+// context switch, is run much longer in the interpreter, so that taking a
+// trap and returning from it is mostly one signal rather than dozens.
+//
+// Instructions that never trap are left to run natively.
+
+// Count a trap at pc, returning how many there have been
+uintptr_t count_trap(struct priv_state *priv, uintptr_t pc);
+
+// Call after a privileged instruction has been emulated, with what count_trap
+// said for it
+void emulate_run(struct priv_state *priv, ucontext_t *ucontext, uintptr_t traps);
+
+// Call when the guest has just entered its trap handler from U-mode
+void emulate_trap_entry(struct priv_state *priv, ucontext_t *ucontext);
@@ -0,0 +1,224 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "patch.h"
+#include "riscv-bits.h"
+#include "stub-layout.h"
+#include "shadow-vm.h"
+
+#include "urvirt-syscalls.h"
+
+static inline size_t ram_page(uintptr_t pa) {
+    return (pa - RAM_START) >> 12;
+}
+
+// The priv_state field CSR csr reads, or NULL. plain_write tells if writing
+// the CSR does nothing else.
+static uintptr_t *csr_field(struct priv_state *priv, uint32_t csr, bool *plain_write) {
+    *plain_write = csr == CSR_SSCRATCH || csr == CSR_SEPC || csr == CSR_SCAUSE || csr == CSR_STVAL;
+
+    if (csr == CSR_SSCRATCH) {
+        return &priv->sscratch;
+    } else if (csr == CSR_STVEC) {
+        return &priv->stvec;
+    } else if (csr == CSR_SEPC) {
+        return &priv->sepc;
+    } else if (csr == CSR_SSTATUS) {
+        return &priv->sstatus;
+    } else if (csr == CSR_SIE) {
+        return &priv->sie;
+    } else if (csr == CSR_SIP) {
+        return &priv->sip;
+    } else if (csr == CSR_SCAUSE) {
+        return &priv->scause;
+    } else if (csr == CSR_STVAL) {
+        return &priv->stval;
+    } else if (csr == CSR_SATP) {
+        return &priv->satp;
+    } else {
+        return NULL;
+    }
+}
+
+// Trampolines count their runs with amoadd.d x0, rd, (rd), rd holding the
+// address of the counter, as there's no other register to add. The counter
+// is picked so that its address is odd in units of 8 bytes, and then the
+// number of runs can be had back, mod 2^61.
+static uintptr_t *hit_counter(struct priv_state *priv, int i) {
+    uintptr_t odd = ((uintptr_t) priv->patch_hits >> 3) & 1;
+    return &priv->patch_hits[i * 2 + (1 - odd)];
+}
+
+static uintptr_t hits(uintptr_t *counter) {
+    uintptr_t k = (uintptr_t) counter >> 3;
+
+    // Inverse of k mod 2^64 by Newton's method, starting from k * k = 1 mod 8
+    uintptr_t inv = k;
+    for (int i = 0; i < 5; i ++) {
+        inv *= 2 - k * inv;
+    }
+
+    return ((*counter >> 3) * inv) & ((1ul << 61) - 1);
+}
+
+// The patched instruction may be only 2-byte aligned
+static void write_instr(uintptr_t pa, uint32_t instr) {
+    uint16_t *p = (uint16_t *) ram_ptr(pa);
+    p[0] = instr;
+    p[1] = instr >> 16;
+}
+
+void patch_init(struct priv_state *priv) {
+    struct patch_state *ps = get_patch();
+
+    for (int i = 0; i < PATCH_SITES; i ++) {
+        ps->sites[i].pa = 0;
+    }
+    ps->used = 0;
+
+    for (size_t page = 0; page < SHADOW_RAM_PAGES; page ++) {
+        ps->page_sites[page] = 0;
+        ps->banned[page] = false;
+    }
+}
+
+void patch_csr(struct priv_state *priv, uintptr_t pc, uint32_t instr) {
+    struct patch_state *ps = get_patch();
+    uint32_t funct3 = ins_funct3(instr);
+    uint32_t op = funct3 & CSR_OP_MASK;
+    uint32_t rd = ins_rd(instr);
+    uint32_t rs1 = ins_rs1(instr);
+
+    // The trampoline works in rd, so there has to be one. With the shared CSR
+    // page, the CSRs in priv_state can be behind.
+    if (ins_opcode(instr) != OPCODE_SYSTEM || op == 0 || rd == 0 || priv->pv_enabled) {
+        return;
+    }
+
+    bool plain_write;
+    uintptr_t *field = csr_field(priv, ins_csr(instr), &plain_write);
+    if (field == NULL) {
+        return;
+    }
+
+    // Reads, and swaps that don't need rs1 after rd is written
+    bool swap = op == CSR_OP_RW;
+    if (swap ? ((funct3 & CSR_USE_UIMM) || ! plain_write || rs1 == rd) : rs1 != 0) {
+        return;
+    }
+
+    // Only S-mode code, so U-mode can't run the patch
+    struct pt_walk walk;
+    if ((pc & 4095) > 4092 || ! lookup_walk(priv, pc, &walk)
+        || walk.pte == 0 || (walk.pte & PTE_U) || ! is_ram_pa(walk.pa)
+        || walk.pa - PATCH_AREA < 4096 || ps->banned[ram_page(walk.pa)]) {
+        return;
+    }
+
+    // A trampoline is never used for anything else once it's been handed
+    // out, even after its site is reverted: a guest thread interrupted in it
+    // may still return there, and has to find it as it was
+    if (ps->used == PATCH_SITES) {
+        return;
+    }
+    int i = ps->used;
+
+    // jal reaches 1 MiB either way
+    uintptr_t tramp_pa = PATCH_AREA + i * PATCH_TRAMP_SIZE;
+    uintptr_t tramp_va = pc + (tramp_pa - walk.pa);
+    intptr_t to = tramp_va - pc;
+    if (to < - (1l << 20) + PATCH_TRAMP_SIZE || to >= (1l << 20) - PATCH_TRAMP_SIZE) {
+        return;
+    }
+
+    uintptr_t pa;
+    uint32_t *tramp = guest_access(priv, tramp_va, PATCH_TRAMP_SIZE, SCAUSE_INSTR_PF, &pa);
+    if (tramp == NULL || pa != tramp_pa) {
+        return;
+    }
+
+    //     auipc rd, 0
+    //     ld rd, 24(rd)            # rd = counter
+    //     amoadd.d x0, rd, (rd)
+    //     ld rd, off(rd)           # or for csrrw:
+    //                              #   addi rd, rd, off
+    //                              #   amoswap.d rd, rs1, (rd)
+    //     j pc + 4
+    //     .dword counter
+    uintptr_t *counter = hit_counter(priv, i);
+    intptr_t off = (intptr_t) field - (intptr_t) counter;
+    int n = 0;
+
+    tramp[n ++] = enc_u(OPCODE_AUIPC, rd, 0);
+    tramp[n ++] = enc_i(OPCODE_LOAD, rd, 3, rd, 24);
+    tramp[n ++] = enc_r(OPCODE_AMO, 0, 3, rd, rd, AMO_ADD << 2);
+    if (swap) {
+        tramp[n ++] = enc_i(OPCODE_OP_IMM, rd, 0, rd, off);
+        tramp[n ++] = enc_r(OPCODE_AMO, rd, 3, rd, rs1, AMO_SWAP << 2);
+    } else {
+        tramp[n ++] = enc_i(OPCODE_LOAD, rd, 3, rd, off);
+    }
+    tramp[n] = enc_j(0, (pc + 4) - (tramp_va + 4 * n));
+    *(uintptr_t *) &tramp[6] = (uintptr_t) counter;
+
+    ps->sites[i].pa = walk.pa;
+    ps->sites[i].orig = instr;
+    ps->used ++;
+    write_instr(walk.pa, enc_j(0, to));
+
+    if (ps->page_sites[ram_page(walk.pa)] ++ == 0) {
+        shadow_reprotect(priv, walk.pa & ~ 4095ul);
+    }
+
+    s_riscv_flush_icache(0, 0, 0);
+    priv->counter_patch_sites ++;
+}
+
+bool patch_has_sites(uintptr_t pa) {
+    return is_ram_pa(pa) && get_patch()->page_sites[ram_page(pa)] != 0;
+}
+
+void patch_phys_access(struct priv_state *priv, uintptr_t pa, size_t len, bool guest_read) {
+    struct patch_state *ps = get_patch();
+    bool reverted = false;
+
+    for (uintptr_t page = pa & ~ 4095ul; page < pa + len; page += 4096) {
+        if (! patch_has_sites(page)) {
+            continue;
+        }
+
+        for (int i = 0; i < PATCH_SITES; i ++) {
+            if (ps->sites[i].pa != 0 && (ps->sites[i].pa & ~ 4095ul) == page) {
+                write_instr(ps->sites[i].pa, ps->sites[i].orig);
+                ps->sites[i].pa = 0;
+
+                uintptr_t *counter = hit_counter(priv, i);
+                priv->counter_patch_hits += hits(counter);
+                *counter = 0;
+
+                priv->counter_patch_sites --;
+                priv->counter_patch_revert ++;
+            }
+        }
+
+        ps->page_sites[ram_page(page)] = 0;
+        ps->banned[ram_page(page)] |= guest_read;
+        shadow_reprotect(priv, page);
+        reverted = true;
+    }
+
+    if (reverted) {
+        s_riscv_flush_icache(0, 0, 0);
+    }
+}
+
+uintptr_t patch_traps_avoided(struct priv_state *priv) {
+    uintptr_t total = priv->counter_patch_hits;
+    for (int i = 0; i < PATCH_SITES; i ++) {
+        if (get_patch()->sites[i].pa != 0) {
+            total += hits(hit_counter(priv, i));
+        }
+    }
+    return total;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "common.h"
+#include "riscv-priv.h"
+#include "shadow-vm.h"
+
+// Patching hot CSR instructions
+//
+// A CSR instruction in S-mode code that keeps trapping is rewritten in guest
+// RAM into a jal to a trampoline, which reads the priv_state field directly.
+// csrrw to a CSR whose writes have no side effects becomes an amoswap.d on
+// the field. A plain write would need a register to hold the address in, and
+// there's none to spare, so those keep trapping.
+//
+// The trampolines live in the last page below KERNEL_START, where firmware
+// would be. The guest never asked for that page, so patching is only done
+// with the loader's -p, for guests known to leave it alone. They're jumped to
+// at the same offset from the patched instruction as in physical memory, so
+// the guest has to map that page next to its code, like an identity or linear
+// mapping would.
+//
+// There are PATCH_SITES trampolines for the life of the guest, after which
+// nothing more is patched.
+//
+// Pages with patches in them are mapped execute-only on the host. Before
+// anything but instruction fetch gets to one, the original instructions are
+// put back. If it's the guest reading its code, say to checksum it, the page
+// isn't patched again.
+
+// Where the trampolines are
+static const uintptr_t PATCH_AREA = KERNEL_START - 4096;
+
+// Bytes of each trampoline
+#define PATCH_TRAMP_SIZE 32
+
+struct patch_site {
+    uintptr_t pa;           // Of the patched instruction, 0 if unused
+    uint32_t orig;          // The instruction as it was
+};
+
+struct patch_state {
+    struct patch_site sites[PATCH_SITES];   // One for each trampoline
+    uint32_t used;                          // Trampolines handed out, which
+                                            // are never reused
+
+    uint8_t page_sites[SHADOW_RAM_PAGES];   // Number of sites in each page of RAM
+    bool banned[SHADOW_RAM_PAGES];          // Don't patch the page again
+};
+
+void patch_init(struct priv_state *priv);
+
+// The privileged instruction instr at pc has just been emulated, after it
+// trapped opts.patch_after times. Patch it, if it's one we can.
+void patch_csr(struct priv_state *priv, uintptr_t pc, uint32_t instr);
+
+// Are there patches in the page at pa?
+bool patch_has_sites(uintptr_t pa);
+
+// Something other than an instruction fetch is about to access guest physical
+// memory at [pa, pa + len). Put the original instructions back there first.
+// guest_read tells if it's the guest reading.
+void patch_phys_access(struct priv_state *priv, uintptr_t pa, size_t len, bool guest_read);
+
+// Number of times patched instructions ran instead of trapping
+uintptr_t patch_traps_avoided(struct priv_state *priv);
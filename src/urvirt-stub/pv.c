@@ -0,0 +1,56 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "pv.h"
+#include "riscv-bits.h"
+#include "stub-layout.h"
+
+// The fields of struct urvirt_pv_csrs, in order
+static const uint32_t pv_csrs[] = {
+    CSR_SSTATUS, CSR_SSCRATCH, CSR_STVEC, CSR_SEPC, CSR_SCAUSE, CSR_STVAL, CSR_SIP, CSR_SIE,
+};
+
+#define PV_CSRS (sizeof(pv_csrs) / sizeof(pv_csrs[0]))
+
+uintptr_t pv_enable(struct priv_state *priv) {
+    if (! priv->pv_enabled) {
+        // Trampolines read and write priv_state, not the page
+        patch_phys_access(priv, RAM_START, RAM_SIZE, false);
+        priv->pv_enabled = true;
+        pv_push(priv);
+    }
+    return PV_PAGE;
+}
+
+void pv_pull(struct priv_state *priv) {
+    if (! priv->pv_enabled) {
+        return;
+    }
+
+    uintptr_t *page = ram_ptr(PV_PAGE);
+    uintptr_t *seen = (uintptr_t *) &priv->pv_seen;
+
+    // Only what the guest changed, so that the page being behind, say on
+    // sip.STIP, doesn't undo what the stub did since
+    for (size_t i = 0; i < PV_CSRS; i ++) {
+        if (page[i] != seen[i]) {
+            seen[i] = page[i];
+            write_csr(priv, pv_csrs[i], page[i]);
+            priv->counter_pv_writes ++;
+        }
+    }
+}
+
+void pv_push(struct priv_state *priv) {
+    if (! priv->pv_enabled) {
+        return;
+    }
+
+    uintptr_t *page = ram_ptr(PV_PAGE);
+    uintptr_t *seen = (uintptr_t *) &priv->pv_seen;
+
+    for (size_t i = 0; i < PV_CSRS; i ++) {
+        seen[i] = page[i] = read_csr(priv, pv_csrs[i]);
+    }
+}
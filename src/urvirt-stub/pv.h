@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "common.h"
+#include "urvirt-pv.h"
+#include "riscv-priv.h"
+#include "patch.h"
+
+// Shared CSR page
+//
+// A guest that asks for it with SBI_URVIRT_PV_CSRS gets a page of guest RAM
+// holding struct urvirt_pv_csrs, and can use loads and stores on it rather
+// than CSR instructions that trap. Around everything the stub does with the
+// CSRs, in the signal handler, enter_trap and handle_priv_instr, the fields
+// the guest changed are written to the CSRs, and then all the CSRs are written
+// back to the page.
+//
+// Patch trampolines would go around the page, so CSR instructions aren't
+// patched once it's in use.
+
+// Where the page is, right below the patch trampolines
+static const uintptr_t PV_PAGE = PATCH_AREA - 4096;
+
+// Turn the page on, returning its guest physical address
+uintptr_t pv_enable(struct priv_state *priv);
+
+// Apply CSR writes the guest made through the page
+void pv_pull(struct priv_state *priv);
+
+// Update the page with the current CSRs
+void pv_push(struct priv_state *priv);
@@ -6,7 +6,13 @@
 #include "riscv-bits.h"
 #include "common.h"
 #include "printf.h"
-#include "urvirt-block.h"
+#include "stub-layout.h"
+#include "shadow-vm.h"
+#include "patch.h"
+#include "pv.h"
+#include "decode.h"
+#include "block.h"
+#include "virtio-blk.h"
 
 #include "urvirt-syscalls.h"
 
@@ -29,6 +35,7 @@ void initialize_priv(struct priv_state *priv) {
     priv->satp = 0;
     priv->sip = 0;
     priv->sie = 0;
+    priv->ext_irqs = 0;
 
     priv->sstatus = 0;
     priv->sstatus = set_sstatus_fs(priv->sstatus, SSTATUS_XS_DIRTY);
@@ -40,6 +47,52 @@ void initialize_priv(struct priv_state *priv) {
     priv->counter_sret = 0;
     priv->counter_uecall = 0;
     priv->counter_secall = 0;
+    priv->counter_satp_switch = 0;
+    priv->counter_satp_reuse = 0;
+    priv->counter_pt_write = 0;
+    priv->counter_sfence = 0;
+    priv->counter_vm_flush = 0;
+    priv->counter_mode_switch = 0;
+    priv->counter_superpage = 0;
+    priv->counter_fault_around = 0;
+    priv->counter_ad_fault = 0;
+    priv->counter_replay_hit = 0;
+    priv->counter_replay_miss = 0;
+    priv->counter_eager_build = 0;
+    priv->counter_eager_skip = 0;
+    priv->counter_vmas = 0;
+    priv->counter_vma_evict = 0;
+    priv->counter_walk_hit = 0;
+    priv->counter_walk_miss = 0;
+    priv->counter_run_instrs = 0;
+    priv->counter_hot_runs = 0;
+    priv->counter_patch_sites = 0;
+    priv->counter_patch_revert = 0;
+    priv->counter_patch_hits = 0;
+    priv->counter_pv_writes = 0;
+    priv->counter_decode_hit = 0;
+    priv->counter_decode_miss = 0;
+    priv->counter_block_cmds = 0;
+    priv->counter_block_syscalls = 0;
+    priv->counter_block_bytes = 0;
+    priv->counter_block_async = 0;
+    priv->counter_vblk_notify = 0;
+    priv->counter_vblk_reqs = 0;
+    priv->counter_overlay_blocks = 0;
+
+    priv->pv_enabled = false;
+
+    for (int i = 0; i < PATCH_SITES * 2; i ++) {
+        priv->patch_hits[i] = 0;
+    }
+
+    for (int i = 0; i < HOT_PC_SIZE; i ++) {
+        priv->hot_pc[i].pc = 0;
+        priv->hot_pc[i].count = 0;
+    }
+
+    walk_cache_flush(priv);
+    decode_init(priv);
 }
 
 uintptr_t read_csr(struct priv_state *priv, uint32_t csr) {
@@ -78,10 +131,11 @@ void write_csr(struct priv_state *priv, uint32_t csr, uintptr_t value) {
         priv->sstatus =
             (value & SSTATUS_WRITABLE_MASK)
             | (priv->sstatus & ~SSTATUS_WRITABLE_MASK);
+        shadow_mode_changed(priv);
     } else if (csr == CSR_SIE) {
         priv->sie =
-            (value & SIX_WRITABLE_MASK)
-            | (priv->sie & ~ SIX_WRITABLE_MASK);
+            (value & SIE_WRITABLE_MASK)
+            | (priv->sie & ~ SIE_WRITABLE_MASK);
     } else if (csr == CSR_SIP) {
         priv->sip =
             (value & SIX_WRITABLE_MASK)
@@ -92,8 +146,9 @@ void write_csr(struct priv_state *priv, uint32_t csr, uintptr_t value) {
         priv->stval = value;
     } else if (csr == CSR_SATP) {
         if (get_satp_mode(value) == SATP_MODE_SV39 || get_satp_mode(value) == SATP_MODE_BARE) {
-            priv->satp = set_satp_asid(value, 0);
-            priv->should_clear_vm = 1;
+            uintptr_t old_satp = priv->satp;
+            priv->satp = value;
+            shadow_switch(priv, old_satp);
         }
     } else {
         write_log("Unimplemented CSR write");
@@ -102,13 +157,20 @@ void write_csr(struct priv_state *priv, uint32_t csr, uintptr_t value) {
 }
 
 void handle_priv_instr(struct priv_state *priv, ucontext_t *ucontext, uint32_t instr) {
+    pv_pull(priv);
+
     if (ins_opcode(instr) == OPCODE_SYSTEM) {
         if (ins_funct3(instr) == FUNCT3_NOT_CSR) {
             // Not CSR
             if (ins_funct7(instr) == FUNCT7_SFENCE_VMA && ins_rd(instr) == 0) {
 
                 // sfence.vma
-                priv->should_clear_vm = 1;
+                uintptr_t *regs = ucontext->uc_mcontext.__gregs;
+                priv->counter_sfence ++;
+                walk_cache_flush(priv);
+                shadow_sfence_vma(priv,
+                    ins_rs1(instr) == 0, regs[ins_rs1(instr)],
+                    ins_rs2(instr) == 0, regs[ins_rs2(instr)]);
                 ucontext->uc_mcontext.__gregs[0] += 4;
 
             } else if (ins_funct7(instr) == FUNCT7_WFI && ins_rs2(instr) == RS2_WFI
@@ -133,11 +195,13 @@ void handle_priv_instr(struct priv_state *priv, ucontext_t *ucontext, uint32_t i
 
                 if (spp == SSTATUS_SPP_U) {
                     priv->priv_mode = PRIV_U;
-                    priv->should_clear_vm = 1;
+                    shadow_mode_changed(priv);
                 } else {
                     priv->priv_mode = PRIV_S;
                 }
 
+                shadow_replay(priv);
+
                 ucontext->uc_mcontext.__gregs[0] = priv->sepc;
             } else {
                 write_log("Invalid instruction: non-CSR");
@@ -193,6 +257,8 @@ void handle_priv_instr(struct priv_state *priv, ucontext_t *ucontext, uint32_t i
         write_log("Invalid instruction: not SYSTEM");
         asm("ebreak");
     }
+
+    pv_push(priv);
 }
 
 static inline uintptr_t trap_target(struct priv_state *priv, uintptr_t scause) {
@@ -208,6 +274,9 @@ static inline uintptr_t trap_target(struct priv_state *priv, uintptr_t scause) {
 
 void enter_trap(struct priv_state *priv, ucontext_t *ucontext, uintptr_t scause, uintptr_t stval) {
     uintptr_t *regs = ucontext->uc_mcontext.__gregs;
+
+    pv_pull(priv);
+
     priv->sepc = regs[0];
     priv->scause = scause;
     priv->stval = stval;
@@ -225,14 +294,51 @@ void enter_trap(struct priv_state *priv, ucontext_t *ucontext, uintptr_t scause,
 
     regs[0] = trap_target(priv, scause);
 
-    priv->should_clear_vm = 1;
+    shadow_mode_changed(priv);
+    pv_push(priv);
+}
+
+// Does the leaf PTE allow the kind of access that caused scause, in the current
+// privilege mode?
+static bool pte_allows(struct priv_state *priv, uint64_t pte, uintptr_t scause) {
+    uintptr_t flags = get_pte_flags(pte);
+
+    if (priv->priv_mode == PRIV_U) {
+        if (! (flags & PTE_U)) return false;
+    } else if (flags & PTE_U) {
+        if (scause == SCAUSE_INSTR_PF || ! get_sstatus_sum(priv->sstatus)) return false;
+    }
+
+    if (scause == SCAUSE_INSTR_PF) {
+        return flags & PTE_X;
+    } else if (scause == SCAUSE_LOAD_PF) {
+        return (flags & PTE_R) || (get_sstatus_mxr(priv->sstatus) && (flags & PTE_X));
+    } else {
+        return flags & PTE_W;
+    }
+}
+
+// Set the Accessed bit, and for a write the Dirty bit too, in the leaf PTE
+// found by a walk, like hardware would. Does nothing without translation.
+static void pte_touch(struct pt_walk *walk, bool write) {
+    uint64_t bits = PTE_A | (write ? PTE_D : 0);
+    if (walk->pte != 0 && (walk->pte & bits) != bits) {
+        // No need to tell the shadow page tables, this is not a change in
+        // translation they care about
+        uint64_t *pte = (uint64_t *) ram_ptr(walk->pte_pa);
+        *pte |= bits;
+        walk->pte = *pte;
+    }
 }
 
 // This is the page table walker. It's ugly. Sorry.
-static bool lookup_pa_in_ram(struct priv_state *priv, void *ram, uintptr_t va, uintptr_t *pa, uint64_t *pte) {
+static bool lookup_pa_in_ram(struct priv_state *priv, void *ram, uintptr_t va, struct pt_walk *walk) {
+    walk->levels = 0;
+
     if (get_satp_mode(priv->satp) == SATP_MODE_BARE) {
-        *pa = va;
-        *pte = 0;
+        walk->pa = va;
+        walk->pte = 0;
+        walk->page_size = 4096;
         return true;
     }
 
@@ -241,18 +347,42 @@ static bool lookup_pa_in_ram(struct priv_state *priv, void *ram, uintptr_t va, u
     if (va_signed != (va_signed << (63 - 39) >> (63 - 39)))
         return false;
 
-    uintptr_t off = get_va_off(va);
     uintptr_t vpn[3] = { get_va_ppn0(va), get_va_ppn1(va), get_va_ppn2(va) };
 
     uintptr_t pt_addr = get_satp_ppn(priv->satp) << 12;
+    int start_level = 0;
+
+    // Skip to the leaf page table if we know where it is
+    uintptr_t tag = (va >> 21) & ((1ul << 18) - 1);
+    struct walk_cache_entry *cached = &priv->walk_cache[tag % WALK_CACHE_SIZE];
+    if (cached->satp == priv->satp && cached->tag == tag) {
+        priv->counter_walk_hit ++;
+        walk->pt[0] = cached->pt[0];
+        walk->pt[1] = cached->pt[1];
+        walk->levels = 2;
+        pt_addr = cached->pt[2];
+        start_level = 2;
+    } else {
+        priv->counter_walk_miss ++;
+    }
 
-    for (int level = 0; level < 3; level ++) {
+    for (int level = start_level; level < 3; level ++) {
         if (pt_addr < RAM_START || pt_addr >= RAM_START + RAM_SIZE) {
             write_log("pt address out of range");
             asm("ebreak");
             return false;
         }
 
+        walk->pt[walk->levels ++] = pt_addr;
+
+        if (level == 2 && start_level == 0) {
+            cached->satp = priv->satp;
+            cached->tag = tag;
+            cached->pt[0] = walk->pt[0];
+            cached->pt[1] = walk->pt[1];
+            cached->pt[2] = pt_addr;
+        }
+
         uint64_t entry = *(uint64_t *)(ram + (pt_addr - RAM_START) + (vpn[level] * 8));
 
 #define fl(f) (get_pte_flags(entry) & PTE_##f)
@@ -260,101 +390,181 @@ static bool lookup_pa_in_ram(struct priv_state *priv, void *ram, uintptr_t va, u
         if (! fl(V)) return false;
         if ((! fl(R)) && fl(W)) return false;
 
-        if (level < 2) {
-            // Should be pointer to next level page table
-            if (fl(R) || fl(W) || fl(X)) {
-                write_log("Unimplemented large pages");
-                asm("ebreak");
-                return false;
-            }
-
-            pt_addr = get_pte_ppn(entry) << 12;
-        } else {
-            if (fl(W) && ! fl(R)) {
-                return false;
-            }
-            *pa = (get_pte_ppn(entry) << 12) | get_va_off(va);
-            *pte = entry;
+        if (fl(R) || fl(X)) {
+            // Leaf entry. At levels 0 and 1 it's a 1 GiB or 2 MiB superpage,
+            // which must be aligned to its size.
+            uintptr_t page_size = 1ul << (30 - 9 * level);
+            uintptr_t base = get_pte_ppn(entry) << 12;
+            if (base & (page_size - 1)) return false;
+
+            walk->pa = base | (va & (page_size - 1));
+            walk->pte = entry;
+            walk->pte_pa = pt_addr + vpn[level] * 8;
+            walk->page_size = page_size;
             return true;
         }
 
+        // Pointer to next level page table, which the last level can't have
+        if (level == 2) return false;
+
+        pt_addr = get_pte_ppn(entry) << 12;
+
 #undef fl
 
     }
 }
 
-bool lookup_pa(struct priv_state *priv, uintptr_t va, uintptr_t *pa, uint64_t *pte) {
-    void *ram = s_mmap(
-        NULL, RAM_SIZE,
-        PROT_READ | PROT_WRITE | PROT_EXEC,
-        MAP_SHARED,
-        RAM_FD, 0
-    );
+void *guest_access(struct priv_state *priv, uintptr_t va, size_t len, uintptr_t scause, uintptr_t *pa) {
+    struct pt_walk walk;
+
+    if ((va & 4095) + len > 4096 || ! lookup_walk(priv, va, &walk) || ! is_ram_pa(walk.pa)) {
+        return NULL;
+    }
+
+    if (walk.pte != 0) {
+        if (! pte_allows(priv, walk.pte, scause)) {
+            return NULL;
+        }
+        pte_touch(&walk, scause == SCAUSE_STORE_PF);
+    }
+
+    if (scause != SCAUSE_INSTR_PF) {
+        patch_phys_access(priv, walk.pa, len, scause == SCAUSE_LOAD_PF);
+    }
+
+    *pa = walk.pa;
+    return ram_ptr(walk.pa);
+}
+
+void walk_cache_flush(struct priv_state *priv) {
+    for (int i = 0; i < WALK_CACHE_SIZE; i ++) {
+        priv->walk_cache[i].satp = 0;
+    }
+}
+
+bool lookup_walk(struct priv_state *priv, uintptr_t va, struct pt_walk *walk) {
+    return lookup_pa_in_ram(priv, get_ram_window(), va, walk);
+}
+
+// The 16 bits at pc, which is 2-byte aligned
+static bool fetch_half(struct priv_state *priv, uintptr_t pc, uint16_t *half) {
+    struct pt_walk walk;
+    if (! lookup_walk(priv, pc, &walk) || walk.pte == 0 || ! is_ram_pa(walk.pa)) {
+        return false;
+    }
+    *half = *(const uint16_t *) ram_ptr(walk.pa);
+    return true;
+}
 
-    bool res = lookup_pa_in_ram(priv, ram, va, pa, pte);
+bool fetch_instr(struct priv_state *priv, uintptr_t pc, uint32_t *instr) {
+    uint16_t lo, hi;
+    if (! fetch_half(priv, pc, &lo)) {
+        return false;
+    }
 
-    s_munmap(ram, RAM_SIZE);
+    // Only read the second half of 32-bit instructions, it may not be there
+    *instr = lo;
+    if ((lo & 0b11) == 0b11) {
+        if (! fetch_half(priv, pc + 2, &hi)) {
+            return false;
+        }
+        *instr |= (uint32_t) hi << 16;
+    }
+    return true;
+}
 
+bool lookup_pa(struct priv_state *priv, uintptr_t va, uintptr_t *pa, uint64_t *pte) {
+    struct pt_walk walk;
+    bool res = lookup_walk(priv, va, &walk);
+    *pa = walk.pa;
+    *pte = walk.pte;
     return res;
 }
 
-static inline int decode_sd(char *pc) {
-    if ((*pc) & 0b11 == 0b11) {
-        uint32_t instr = *(uint32_t *) pc;
+// Read or write len bytes of the device register at pa. Returns false if
+// there's no device there.
+static bool mmio_access(struct priv_state *priv, uintptr_t pa, size_t len, bool write, uintptr_t *value) {
+    if (pa >= URVIRT_VIRTIO_BLK && pa - URVIRT_VIRTIO_BLK < URVIRT_VIRTIO_BLK_SIZE) {
+        return vblk_access(priv, pa, len, write, value);
+    }
+    return urvb_access(priv, pa, write, value);
+}
+
+// Emulate the load, store or AMO at pc, which faulted on MMIO at pa
+static void emulate_mmio(struct priv_state *priv, ucontext_t *ucontext, uintptr_t scause, uintptr_t va, uintptr_t pa) {
+    uintptr_t *regs = ucontext->uc_mcontext.__gregs;
+    uintptr_t pc = regs[0];
+    uint32_t instr;
+    const struct mem_insn *insn = fetch_instr(priv, pc, &instr) ? decode_mem(priv, pc, instr) : NULL;
+
+    if (insn == NULL || insn->kind == MEM_NONE) {
+        printf("[urvirt] Can't emulate MMIO access, sepc=0x%zx, va=0x%zx, pa=0x%zx\n", pc, va, pa);
+        asm("ebreak");
+    }
+
+    // The data register, NULL for x0. regs[0] is pc, not x0.
+    uintptr_t *reg = NULL;
+    if (insn->fp) {
+        reg = (uintptr_t *) &ucontext->uc_mcontext.__fpregs.__d.__f[insn->reg];
+    } else if (insn->reg != 0) {
+        reg = &regs[insn->reg];
+    }
 
-        if (ins_opcode(instr) == OPCODE_STORE) {
-            if (ins_funct3(instr) == 0b011) {
-                return ins_rs2(instr);
+    uintptr_t data = reg == NULL ? 0 : *reg;
+    uintptr_t src = insn->rs2 == 0 ? 0 : regs[insn->rs2];
+    bool ok;
+
+    if (insn->kind == MEM_STORE) {
+        data = mem_insn_extend(insn, data);
+        ok = mmio_access(priv, pa, insn->len, true, &data);
+    } else {
+        ok = mmio_access(priv, pa, insn->len, false, &data);
+        data = mem_insn_extend(insn, data);
+
+        if (ok && insn->kind == MEM_AMO) {
+            uintptr_t value = src;
+            if (insn->amo == AMO_SC) {
+                // There's no reservation to lose, it always succeeds
+                data = 0;
             } else {
-                return -1;
+                amo_value(insn->amo, insn->len, data, src, &value);
             }
+            ok = mmio_access(priv, pa, insn->len, true, &value);
         }
-    } else {
-        uint16_t instr = *(uint16_t *) pc;
 
-        uint16_t op = instr & 0b11;
-        uint16_t funct3 = instr >> 13;
+        // flw NaN-boxes
+        if (insn->fp && insn->len == 4) {
+            data |= ~ 0ul << 32;
+        }
 
-        if (op == 0b00 && funct3 == 0b111) {
-            // c.sd
-            return ((instr >> 2) & 0b111) | 8;
-        } else if (op == 0b10 && funct3 == 0b011) {
-            // c.sdsp
-            return (instr >> 2) & 0b11111;
-        } else {
-            return -1;
+        if (reg != NULL) {
+            *reg = data;
         }
     }
-}
 
-static inline bool get_store_data(ucontext_t *ucontext, uintptr_t *data) {
-    uintptr_t pc = ucontext->uc_mcontext.__gregs[0];
-    int rs2 = decode_sd((char *) pc);
-    if (rs2 >= 0) {
-        *data = ucontext->uc_mcontext.__gregs[rs2];
-        return true;
-    } else {
-        return false;
+    if (! ok) {
+        printf("[urvirt] Page fault, sepc=0x%zx, va=0x%zx, pa=0x%zx, scause=%d cannot handle\n",
+            pc, va, pa, scause
+        );
+        asm("ebreak");
     }
+
+    regs[0] += insn->ilen;
 }
 
 void handle_page_fault(struct priv_state *priv, ucontext_t *ucontext, uintptr_t scause, uintptr_t stval) {
-    uintptr_t pa;
-    uint64_t pte;
-    bool found = lookup_pa(priv, stval, &pa, &pte);
+    struct pt_walk walk;
+    bool found = lookup_walk(priv, stval, &walk);
+    uintptr_t pa = walk.pa;
+    uint64_t pte = walk.pte;
     if (found) {
         if (pte == 0) {
             // No translation
             write_log("someone turned off translation");
             asm("ebreak");
         } else {
-            uintptr_t ppn = get_pte_ppn(pte);
-            if (pa >= RAM_START && pa < RAM_START + RAM_SIZE) {
-                int flags = 0;
-
-                if ((scause == SCAUSE_INSTR_PF && ! (get_pte_flags(pte) & PTE_X))
-                    || (scause == SCAUSE_LOAD_PF && ! (get_pte_flags(pte) & PTE_R))
-                    || (scause == SCAUSE_STORE_PF && ! (get_pte_flags(pte) & PTE_W))) {
+            if (is_ram_pa(pa)) {
+                if (! pte_allows(priv, pte, scause)) {
                     // Permission denied
                     if (priv->priv_mode == PRIV_S) {
                         write_log("page permission denied in s mode");
@@ -364,71 +574,11 @@ void handle_page_fault(struct priv_state *priv, ucontext_t *ucontext, uintptr_t
                     }
                     enter_trap(priv, ucontext, scause, stval);
                 } else {
-                    if (get_pte_flags(pte) & PTE_R) flags |= PROT_READ;
-                    if (get_pte_flags(pte) & PTE_W) flags |= PROT_WRITE;
-                    if (get_pte_flags(pte) & PTE_X) flags |= PROT_EXEC;
-
-                    void *res = s_mmap(
-                        (void *) (((uintptr_t) stval) & ~((1 << 12) - 1)), 4096,
-                        flags,
-                        MAP_SHARED | MAP_FIXED_NOREPLACE,
-                        RAM_FD, (ppn << 12) - RAM_START
-                    );
-                    if ((intptr_t)(res) < 0) {
-                        // Linux mmap(2) does not like us mapping like literally half the address in Sv39 space.
-                        //
-                        // Honestly, not much we can do with that.
-                        printf("[urvirt] Trying to mmap failed, addr=0x%zx, errno=%d\n", stval, - (int)(intptr_t)(res));
-                        asm("ebreak");
-                    }
+                    pte_touch(&walk, scause == SCAUSE_STORE_PF);
+                    shadow_map_fault(priv, stval, scause, &walk);
                 }
             } else {
-                uintptr_t pc = ucontext->uc_mcontext.__gregs[0];
-
-                uintptr_t store_data;
-
-                if (scause == SCAUSE_STORE_PF) {
-                    if (! get_store_data(ucontext, &store_data)) {
-                        printf("[urvirt] Failed to get MMIO store data\n");
-                        asm("ebreak");
-                    }
-                }
-
-                if (pa == URVIRT_BLOCK + URVIRT_BLOCK_COMMAND && scause == SCAUSE_STORE_PF) {
-                    printf("[urvirt] urvirt block command %zd, block_id=%zd, buf=0x%zx\n",
-                        store_data, priv->urvb_block_id, priv->urvb_buf);
-                    if (store_data == URVIRT_BLOCK_CMD_READ) {
-                        s_pread64(BLOCK_FD, (void *) priv->urvb_buf, URVIRT_BLOCK_SIZE, URVIRT_BLOCK_SIZE * priv->urvb_block_id);
-                    } else if (store_data == URVIRT_BLOCK_CMD_WRITE) {
-                        s_pwrite64(BLOCK_FD, (const void *) priv->urvb_buf, URVIRT_BLOCK_SIZE, URVIRT_BLOCK_SIZE * priv->urvb_block_id);
-                    } else {
-                        asm("ebreak");
-                    }
-                    if ((*(char *) pc) & 0b11 == 0b11)
-                        ucontext->uc_mcontext.__gregs[0] += 4;
-                    else
-                        ucontext->uc_mcontext.__gregs[0] += 2;
-
-                } else if (pa == URVIRT_BLOCK + URVIRT_BLOCK_BLOCK_ID && scause == SCAUSE_STORE_PF) {
-                    priv->urvb_block_id = store_data;
-                    if ((*(char *) pc) & 0b11 == 0b11)
-                        ucontext->uc_mcontext.__gregs[0] += 4;
-                    else
-                        ucontext->uc_mcontext.__gregs[0] += 2;
-                } else if (pa == URVIRT_BLOCK + URVIRT_BLOCK_BUF && scause == SCAUSE_STORE_PF) {
-                    priv->urvb_buf = store_data;
-                    if ((*(char *) pc) & 0b11 == 0b11)
-                        ucontext->uc_mcontext.__gregs[0] += 4;
-                    else
-                        ucontext->uc_mcontext.__gregs[0] += 2;
-                } else {
-                    printf("[urvirt] Page fault, sepc=0x%zx, rs2=x%d, va=0x%zx, pa=0x%zx, scause=%d cannot handle\n",
-                        (size_t) pc, decode_sd((char *) pc),
-                        stval, pa, scause
-                    );
-
-                    asm("ebreak");
-                }
+                emulate_mmio(priv, ucontext, scause, stval, pa);
             }
         }
     } else {
@@ -6,14 +6,68 @@
 #include <time.h>
 #include <ucontext.h>
 
+#include "common.h"
+#include "urvirt-pv.h"
+#include "riscv-bits.h"
+
+// Number of entries of the page walk cache
+#define WALK_CACHE_SIZE 32
+
+// Number of CSR instructions that can be patched at a time, see patch.h
+#define PATCH_SITES 32
+
+// Number of entries of the table of trap counts by pc
+#define HOT_PC_SIZE 64
+
+// Number of entries of the decoded memory instruction cache
+#define MEM_INSN_CACHE_SIZE 16
+
+// A memory instruction, as decoded by decode_mem
+struct mem_insn {
+    uintptr_t pc;           // Guest pc it's for
+    uint32_t bits;          // The instruction, in case it's changed since
+    uint8_t kind;           // MEM_*, see decode.h
+    uint8_t len;            // Bytes accessed
+    uint8_t ilen;           // Bytes of the instruction
+    uint8_t reg;            // Data register, rd for loads and AMOs, rs2 for stores
+    uint8_t rs2;            // Source operand of AMOs
+    uint8_t amo;            // funct5 of AMOs
+    bool sign;              // Loads sign extend
+    bool fp;                // reg is an FP register
+};
+
+// How often the guest trapped at a pc
+struct hot_pc {
+    uintptr_t pc;           // Guest pc, 0 if unused
+    uintptr_t count;        // Traps there since the entry was taken
+};
+
+// Page walk cache entry, for the 2 MiB of address space at tag << 21
+struct walk_cache_entry {
+    uintptr_t satp;         // satp it's for, 0 if unused
+    uintptr_t tag;          // VPN[2] and VPN[1] of the address
+    uintptr_t pt[3];        // Page table pages down to the leaf page table
+};
+
 struct priv_state {
     // The start of urvirt_config
     void *stub_start;
     size_t stub_size;
     size_t kernel_size;
+    struct urvirt_options opts;
 
     timer_t timerid;        // Start address of the stub
 
+    int ecall_mode;         // ECALL_SECCOMP or ECALL_DISPATCH, whichever is in use
+    char sud_selector;      // Syscall user dispatch selector
+
+    int block_copy;         // BLOCK_COPY_*, AUTO until copy_file_range was
+                            // tried
+
+    uint64_t overlay_data;  // Where the blocks are in the overlay delta
+    size_t overlay_blocks;  // Blocks in the overlay base
+    bool ramdisk_dirty;     // The RAM disk was written to since it was loaded
+
     uintptr_t priv_mode;    // Current privilege mode
 
     // All the CSRs
@@ -28,29 +82,136 @@ struct priv_state {
     uintptr_t sie;
     uintptr_t satp;
 
-    // URVirt block device
-    uintptr_t urvb_block_id;
-    uintptr_t urvb_buf;
+    // Run counts of patch trampolines, see patch.c. They have to be within
+    // reach of a 12-bit offset from the CSRs.
+    uintptr_t patch_hits[PATCH_SITES * 2];
+
+    // Shared CSR page, see pv.h
+    bool pv_enabled;
+    struct urvirt_pv_csrs pv_seen;  // What the page held after the last pv_push
 
-    // Should we reset virtual memory mappings before returning from signal
-    // handler and executing the next instruction?
-    bool should_clear_vm;
+    uintptr_t ext_irqs;     // Devices raising the external interrupt, EXT_IRQ_*
 
     uintptr_t counter_ill;
     uintptr_t counter_segv;
     uintptr_t counter_sret;
     uintptr_t counter_uecall;
     uintptr_t counter_secall;
+    uintptr_t counter_satp_switch;
+    uintptr_t counter_satp_reuse;
+    uintptr_t counter_pt_write;
+    uintptr_t counter_sfence;
+    uintptr_t counter_vm_flush;
+    uintptr_t counter_mode_switch;
+    uintptr_t counter_superpage;
+    uintptr_t counter_fault_around;
+    uintptr_t counter_ad_fault;
+    uintptr_t counter_replay_hit;
+    uintptr_t counter_replay_miss;
+    uintptr_t counter_eager_build;
+    uintptr_t counter_eager_skip;
+    uintptr_t counter_vmas;
+    uintptr_t counter_vma_evict;
+    uintptr_t counter_walk_hit;
+    uintptr_t counter_walk_miss;
+    uintptr_t counter_run_instrs;
+    uintptr_t counter_hot_runs;
+    uintptr_t counter_patch_sites;
+    uintptr_t counter_patch_revert;
+    uintptr_t counter_patch_hits;
+    uintptr_t counter_pv_writes;
+    uintptr_t counter_decode_hit;
+    uintptr_t counter_decode_miss;
+    uintptr_t counter_block_cmds;
+    uintptr_t counter_block_syscalls;
+    uintptr_t counter_block_bytes;
+    uintptr_t counter_block_async;
+    uintptr_t counter_vblk_notify;
+    uintptr_t counter_vblk_reqs;
+    uintptr_t counter_overlay_blocks;
+
+    // Where the leaf page tables are, for recently walked addresses. Since
+    // satp is part of the key, a satp write need not flush it, but sfence.vma
+    // and writes to page table pages do.
+    struct walk_cache_entry walk_cache[WALK_CACHE_SIZE];
+
+    // Trap counts, direct mapped by pc, see interp.h
+    struct hot_pc hot_pc[HOT_PC_SIZE];
+
+    // Decoded memory instructions, see decode.h
+    struct mem_insn mem_insns[MEM_INSN_CACHE_SIZE];
+};
+
+// Result of walking the guest page table
+struct pt_walk {
+    uintptr_t pa;       // Translated physical address
+    uint64_t pte;       // Leaf PTE, or 0 if translation is off
+    uintptr_t pte_pa;   // Physical address of the leaf PTE
+    uintptr_t page_size; // Size of the page pte maps, 4 KiB, 2 MiB or 1 GiB
+    uintptr_t pt[3];    // Physical addresses of the page table pages visited
+    int levels;         // Number of entries in pt
 };
 
+// Devices that can raise the external interrupt. There's no PLIC, sip.SEIP
+// is up while any of them is, and the guest asks each one.
+static const uintptr_t EXT_IRQ_URVB = 1;
+static const uintptr_t EXT_IRQ_VBLK = 2;
+
+static inline void set_external_irq(struct priv_state *priv, uintptr_t source, bool level) {
+    priv->ext_irqs = level ? priv->ext_irqs | source : priv->ext_irqs & ~ source;
+    priv->sip = set_six_sei(priv->sip, priv->ext_irqs != 0);
+}
+
+// The interrupt to take right now, as an scause, or 0 if there's none
+static inline uintptr_t pending_interrupt(struct priv_state *priv) {
+    if (! get_sstatus_sie(priv->sstatus) && priv->priv_mode == PRIV_S) {
+        return 0;
+    }
+
+    uintptr_t pending = priv->sip & priv->sie;
+    if (get_six_sei(pending)) {
+        return SCAUSE_EXTERNAL;
+    } else if (get_six_sti(pending)) {
+        return SCAUSE_TIMER;
+    } else {
+        return 0;
+    }
+}
+
+// Is there an interrupt to take right now?
+static inline bool interrupt_pending(struct priv_state *priv) {
+    return pending_interrupt(priv) != 0;
+}
+
 void initialize_priv(struct priv_state *priv);
+uintptr_t read_csr(struct priv_state *priv, uint32_t csr);
+void write_csr(struct priv_state *priv, uint32_t csr, uintptr_t value);
 void handle_priv_instr(struct priv_state *priv, ucontext_t *ucontext, uint32_t instr);
 void enter_trap(struct priv_state *priv, ucontext_t *ucontext, uintptr_t scause, uintptr_t stval);
 
+// Translate guest virtual address va with the current satp. Returns false if
+// there's no valid translation.
+bool lookup_walk(struct priv_state *priv, uintptr_t va, struct pt_walk *walk);
+
+// Forget all of the page walk cache
+void walk_cache_flush(struct priv_state *priv);
+
+// Translate an access of len bytes at va, all in one page, of the kind that
+// would cause scause on failure, the way hardware would in the current
+// privilege mode, Accessed and Dirty bits included. Returns where it is in
+// the RAM window, or NULL if the access would fault or isn't to RAM.
+void *guest_access(struct priv_state *priv, uintptr_t va, size_t len, uintptr_t scause, uintptr_t *pa);
+bool lookup_pa(struct priv_state *priv, uintptr_t va, uintptr_t *pa, uint64_t *pte);
+
+// Read the instruction at pc, 16 or 32 bits, through the RAM window. The host
+// mapping of pc may be execute-only, see patch.h, so it's never read there,
+// and the halves of a 32-bit instruction are translated one by one, as it may
+// cross a page. Returns false if pc isn't mapped to RAM.
+bool fetch_instr(struct priv_state *priv, uintptr_t pc, uint32_t *instr);
+
 // Handle SIGSEGV. If permissions allow, map memory and retry, otherwise
-// generate page fault trap
-//
-// TODO: Emulation of load/store instructions
+// generate page fault trap. Loads, stores and AMOs on MMIO are emulated with
+// emulate_mmio, see decode.h.
 //
 // \param stval The faulting address
 void handle_page_fault(struct priv_state *priv, ucontext_t *ucontext, uintptr_t scause, uintptr_t stval);
@@ -0,0 +1,1254 @@
+#include <sys/mman.h>
+
+#include "shadow-vm.h"
+#include "riscv-bits.h"
+#include "common.h"
+#include "printf.h"
+#include "stub-layout.h"
+#include "patch.h"
+
+#include "urvirt-syscalls.h"
+
+static inline int spte_prot(uint64_t ent) {
+    return (ent & SPTE_PROT_MASK) >> SPTE_PROT_SHIFT;
+}
+
+static inline uint64_t spte_installed(uint64_t pte, int prot) {
+    return (pte & ~ (SPTE_PROT_MASK | SPTE_INSTALLED))
+        | SPTE_INSTALLED
+        | ((uint64_t) prot << SPTE_PROT_SHIFT);
+}
+
+// Installed because the guest needed it just now
+static inline uint64_t spte_faulted(uint64_t pte, int prot) {
+    return spte_installed(pte, prot) | SPTE_REF;
+}
+
+// Do two entries describe the same guest translation?
+static inline bool spte_same(uint64_t a, uint64_t b) {
+    uint64_t mask = ~ (SPTE_PROT_MASK | SPTE_INSTALLED | SPTE_REF);
+    return (a & mask) == (b & mask);
+}
+
+// Same, but not caring about the Accessed and Dirty bits
+static inline bool spte_same_ad(uint64_t a, uint64_t b) {
+    return spte_same(a | PTE_A | PTE_D, b | PTE_A | PTE_D);
+}
+
+static inline uintptr_t spte_pa(uint64_t ent) {
+    return get_pte_ppn(ent) << 12;
+}
+
+static inline size_t ram_page(uintptr_t pa) {
+    return (pa - RAM_START) >> 12;
+}
+
+static inline bool is_pt_page(struct shadow_state *sh, uintptr_t pa) {
+    return is_ram_pa(pa) && sh->pt_ctxs[ram_page(pa)] != 0;
+}
+
+// Host protection flags for a guest leaf PTE
+static int host_prot(struct shadow_state *sh, uint64_t pte) {
+    uintptr_t flags = get_pte_flags(pte);
+    int prot = 0;
+    if (flags & PTE_R) prot |= PROT_READ;
+    if (flags & PTE_W) prot |= PROT_WRITE;
+    if (flags & PTE_X) prot |= PROT_EXEC;
+
+    if (sh->view_mxr && (flags & PTE_X)) prot |= PROT_READ;
+
+    // Emulate the Accessed and Dirty bits by making the first access, and the
+    // first write, fault
+    if (! (flags & PTE_A)) prot = PROT_NONE;
+    if (! (flags & PTE_D)) prot &= ~ PROT_WRITE;
+
+    if (sh->view_user) {
+        if (! (flags & PTE_U)) prot = PROT_NONE;
+    } else if (flags & PTE_U) {
+        // S-mode never executes U-mode pages, and only accesses them with SUM
+        prot = sh->view_sum ? (prot & ~ PROT_EXEC) : PROT_NONE;
+    }
+
+    return prot;
+}
+
+// Host protection flags for one page of a leaf mapped with prot. Page table
+// pages are write-protected, to keep an eye on writes to them, and patched
+// code can only be run.
+static inline int page_prot(struct shadow_state *sh, int prot, uintptr_t pa) {
+    if (patch_has_sites(pa)) {
+        prot &= PROT_EXEC;
+    }
+    return is_pt_page(sh, pa) ? (prot & ~ PROT_WRITE) : prot;
+}
+
+// Can a leaf mapped with prot have pages mapped with less?
+static inline bool may_have_holes(int prot) {
+    return (prot & (PROT_READ | PROT_WRITE)) != 0;
+}
+
+static inline size_t level_size(int level) {
+    return 1ul << (30 - 9 * level);
+}
+
+static inline int size_level(size_t size) {
+    if (size == level_size(0)) return 0;
+    if (size == level_size(1)) return 1;
+    return 2;
+}
+
+// The part of a leaf that is in RAM, and so is mapped on the host. A gigapage
+// can be larger than all of RAM.
+struct leaf_window {
+    uintptr_t va;
+    uintptr_t pa;
+    size_t len;
+};
+
+static bool leaf_window(uintptr_t va, size_t size, uint64_t ent, struct leaf_window *w) {
+    uintptr_t pa = spte_pa(ent);
+    uintptr_t start = pa < RAM_START ? RAM_START : pa;
+    uintptr_t end = pa + size > RAM_START + RAM_SIZE ? RAM_START + RAM_SIZE : pa + size;
+    if (start >= end) {
+        return false;
+    }
+
+    w->va = va + (start - pa);
+    w->pa = start;
+    w->len = end - start;
+    return true;
+}
+
+// Host mapping operations
+//
+// Each of them can add a host VMA, or two for changing protection in the
+// middle of one. sh->vmas counts them pessimistically, and every now and then
+// vma_check counts them properly.
+
+static void host_map(uintptr_t va, size_t len, uintptr_t pa, int prot) {
+    get_shadow()->vmas ++;
+
+    void *res = s_mmap(
+        (void *) va, len,
+        prot,
+        MAP_SHARED | MAP_FIXED_NOREPLACE,
+        RAM_FD, pa - RAM_START
+    );
+    if ((intptr_t)(res) < 0) {
+        // Linux mmap(2) does not like us mapping like literally half the address in Sv39 space.
+        //
+        // Honestly, not much we can do with that.
+        printf("[urvirt] Trying to mmap failed, addr=0x%zx, errno=%d\n", va, - (int)(intptr_t)(res));
+        asm("ebreak");
+    }
+
+    // Ask for huge pages on the host too where the guest has them. This only
+    // does anything if the host has transparent huge pages enabled for shmem.
+    if (((va | (pa - RAM_START)) & (level_size(1) - 1)) == 0 && len >= level_size(1)) {
+        s_madvise((void *) va, len, MADV_HUGEPAGE);
+    }
+}
+
+static void host_protect(uintptr_t va, size_t len, int prot) {
+    get_shadow()->vmas += 2;
+    s_mprotect((void *) va, len, prot);
+}
+
+static void host_unmap(uintptr_t va, size_t len) {
+    get_shadow()->vmas ++;
+    s_munmap((void *) va, len);
+}
+
+// Protect the pages in a window just mapped or mprotect'ed with prot as a
+// whole as page_prot says. Any batch covering the window must be flushed
+// first.
+static void protect_holes(struct shadow_state *sh, const struct leaf_window *w, int prot) {
+    if (! may_have_holes(prot)) {
+        return;
+    }
+
+    for (uintptr_t off = 0; off < w->len; off += 4096) {
+        int page = page_prot(sh, prot, w->pa + off);
+        if (page != prot) {
+            host_protect(w->va + off, 4096, page);
+        }
+    }
+}
+
+static bool has_holes(struct shadow_state *sh, const struct leaf_window *w, int prot) {
+    if (may_have_holes(prot)) {
+        for (uintptr_t off = 0; off < w->len; off += 4096) {
+            if (page_prot(sh, prot, w->pa + off) != prot) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Adjacent host mappings, so that we can change them with one system call
+struct host_batch {
+    uintptr_t va;
+    size_t len;
+    uintptr_t pa;
+    int prot;
+};
+
+static void unmap_flush(struct host_batch *b) {
+    if (b->len) {
+        host_unmap(b->va, b->len);
+        b->len = 0;
+    }
+}
+
+static void unmap_add(struct host_batch *b, uintptr_t va, size_t len) {
+    if (b->len && b->va + b->len == va) {
+        b->len += len;
+    } else {
+        unmap_flush(b);
+        b->va = va;
+        b->len = len;
+    }
+}
+
+static void protect_flush(struct host_batch *b) {
+    if (b->len) {
+        host_protect(b->va, b->len, b->prot);
+        b->len = 0;
+    }
+}
+
+static void protect_add(struct host_batch *b, uintptr_t va, size_t len, int prot) {
+    if (b->len && b->va + b->len == va && b->prot == prot) {
+        b->len += len;
+    } else {
+        protect_flush(b);
+        b->va = va;
+        b->len = len;
+        b->prot = prot;
+    }
+}
+
+static void map_flush(struct host_batch *b) {
+    if (b->len) {
+        host_map(b->va, b->len, b->pa, b->prot);
+        b->len = 0;
+    }
+}
+
+static void map_add(struct host_batch *b, uintptr_t va, size_t len, uintptr_t pa, int prot) {
+    if (b->len && b->va + b->len == va && b->pa + b->len == pa && b->prot == prot) {
+        b->len += len;
+    } else {
+        map_flush(b);
+        b->va = va;
+        b->len = len;
+        b->pa = pa;
+        b->prot = prot;
+    }
+}
+
+// Shadow page table nodes
+
+static uint32_t alloc_node(struct shadow_state *sh) {
+    uint32_t node = sh->free_node;
+    if (node == 0) {
+        return 0;
+    }
+
+    sh->free_node = sh->nodes[node].ent[0];
+    for (int i = 0; i < 512; i ++) {
+        sh->nodes[node].ent[i] = 0;
+    }
+    return node;
+}
+
+// Is this valid entry at the given level a leaf, rather than a pointer to the
+// next node?
+static inline bool is_leaf(uint64_t ent, int level) {
+    return level == 2 || (get_pte_flags(ent) & (PTE_R | PTE_W | PTE_X));
+}
+
+static void free_tree(struct shadow_state *sh, uint32_t node, int level) {
+    if (level < 2) {
+        for (int i = 0; i < 512; i ++) {
+            uint64_t ent = sh->nodes[node].ent[i];
+            if ((get_pte_flags(ent) & PTE_V) && ! is_leaf(ent, level)) {
+                free_tree(sh, get_pte_ppn(ent), level + 1);
+            }
+        }
+    }
+
+    sh->nodes[node].ent[0] = sh->free_node;
+    sh->free_node = node;
+}
+
+static inline uintptr_t va_index(uintptr_t va, int level) {
+    if (level == 0) return get_va_ppn0(va);
+    if (level == 1) return get_va_ppn1(va);
+    return get_va_ppn2(va);
+}
+
+// Find the leaf entry for va, or NULL if there is none. The level of the leaf
+// goes to *level.
+static uint64_t *lookup_leaf(struct shadow_state *sh, struct shadow_ctx *ctx, uintptr_t va, int *level) {
+    uint32_t node = ctx->root;
+    if (node == 0) {
+        return NULL;
+    }
+
+    for (int l = 0; l < 3; l ++) {
+        uint64_t *ent = &sh->nodes[node].ent[va_index(va, l)];
+        if (! (get_pte_flags(*ent) & PTE_V)) {
+            return NULL;
+        }
+        if (is_leaf(*ent, l)) {
+            *level = l;
+            return ent;
+        }
+        node = get_pte_ppn(*ent);
+    }
+
+    return NULL;
+}
+
+// Find or make room for a leaf entry for va at the given level. Returns NULL
+// if we're out of nodes. Whatever used to be in the way must have been
+// removed with clear_slot.
+static uint64_t *insert_leaf(struct shadow_state *sh, struct shadow_ctx *ctx, uintptr_t va, int level) {
+    if (ctx->root == 0) {
+        ctx->root = alloc_node(sh);
+        if (ctx->root == 0) {
+            return NULL;
+        }
+    }
+
+    uint32_t node = ctx->root;
+
+    for (int l = 0; l < level; l ++) {
+        uint64_t *ent = &sh->nodes[node].ent[va_index(va, l)];
+        if (! (get_pte_flags(*ent) & PTE_V)) {
+            uint32_t next = alloc_node(sh);
+            if (next == 0) {
+                return NULL;
+            }
+            *ent = set_pte_ppn(0, next) | PTE_V;
+        }
+        node = get_pte_ppn(*ent);
+    }
+
+    return &sh->nodes[node].ent[va_index(va, level)];
+}
+
+typedef void (*leaf_fn)(struct shadow_state *sh, uintptr_t va, size_t size, uint64_t *ent, void *arg);
+
+static void for_each_leaf_in(struct shadow_state *sh, uint32_t node, int level, uintptr_t va, leaf_fn fn, void *arg) {
+    for (uintptr_t i = 0; i < 512; i ++) {
+        uint64_t *ent = &sh->nodes[node].ent[i];
+        if (! (get_pte_flags(*ent) & PTE_V)) {
+            continue;
+        }
+
+        uintptr_t shift = 30 - 9 * level;
+        uintptr_t next_va = va | (i << shift);
+        if (level == 0 && (i & 0x100)) {
+            // Sign extend
+            next_va |= ~ ((1ul << 39) - 1);
+        }
+
+        if (is_leaf(*ent, level)) {
+            fn(sh, next_va, level_size(level), ent, arg);
+        } else {
+            for_each_leaf_in(sh, get_pte_ppn(*ent), level + 1, next_va, fn, arg);
+        }
+    }
+}
+
+// Call fn for every leaf entry of ctx, in increasing order of address
+static void for_each_leaf(struct shadow_state *sh, struct shadow_ctx *ctx, leaf_fn fn, void *arg) {
+    if (ctx->root) {
+        for_each_leaf_in(sh, ctx->root, 0, 0, fn, arg);
+    }
+}
+
+// Contexts
+
+static void unmap_leaf_fn(struct shadow_state *sh, uintptr_t va, size_t size, uint64_t *ent, void *arg) {
+    struct leaf_window w;
+    if (*ent & SPTE_INSTALLED) {
+        if (leaf_window(va, size, *ent, &w)) {
+            unmap_add((struct host_batch *) arg, w.va, w.len);
+        }
+        *ent &= ~ SPTE_INSTALLED;
+    }
+}
+
+// Remove the host mappings of a context
+static void unmap_ctx(struct shadow_state *sh, struct shadow_ctx *ctx) {
+    struct host_batch b = { .len = 0 };
+    for_each_leaf(sh, ctx, unmap_leaf_fn, &b);
+    unmap_flush(&b);
+}
+
+// Remove everything in the way of a leaf for va at the given level: a larger
+// leaf containing it, or a node with smaller leaves inside it
+static void clear_slot(struct shadow_state *sh, struct shadow_ctx *ctx, uintptr_t va, int level, struct host_batch *unmap) {
+    uint32_t node = ctx->root;
+    if (node == 0) {
+        return;
+    }
+
+    for (int l = 0; l <= level; l ++) {
+        uint64_t *ent = &sh->nodes[node].ent[va_index(va, l)];
+        if (! (get_pte_flags(*ent) & PTE_V)) {
+            return;
+        }
+
+        uintptr_t slot_va = va & ~ (level_size(l) - 1);
+
+        if (is_leaf(*ent, l)) {
+            unmap_leaf_fn(sh, slot_va, level_size(l), ent, unmap);
+            *ent = 0;
+            return;
+        }
+
+        if (l == level) {
+            uint32_t child = get_pte_ppn(*ent);
+            for_each_leaf_in(sh, child, l + 1, slot_va, unmap_leaf_fn, unmap);
+            free_tree(sh, child, l + 1);
+            *ent = 0;
+            return;
+        }
+
+        node = get_pte_ppn(*ent);
+    }
+}
+
+// Drop all translations of a context, which must not be installed. Its
+// working set is kept around for replaying.
+static void forget_ctx(struct shadow_state *sh, int i) {
+    struct shadow_ctx *ctx = &sh->ctx[i];
+    if (ctx->root) {
+        free_tree(sh, ctx->root, 0);
+        ctx->root = 0;
+        ctx->replay = true;
+    }
+    ctx->stale = false;
+
+    for (size_t page = 0; page < SHADOW_RAM_PAGES; page ++) {
+        sh->pt_ctxs[page] &= ~ (1 << i);
+    }
+}
+
+static int find_ctx(struct shadow_state *sh, uintptr_t satp) {
+    for (int i = 0; i < SHADOW_CTXS; i ++) {
+        if (sh->ctx[i].satp == satp) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Pick a slot for a new context, reusing the least recently used one
+static int alloc_ctx(struct shadow_state *sh, uintptr_t satp) {
+    int victim = -1;
+    for (int i = 0; i < SHADOW_CTXS; i ++) {
+        if (i == sh->cur) {
+            continue;
+        }
+        if (victim < 0 || sh->ctx[i].last_used < sh->ctx[victim].last_used) {
+            victim = i;
+        }
+    }
+
+    struct shadow_ctx *ctx = &sh->ctx[victim];
+    forget_ctx(sh, victim);
+    ctx->satp = satp;
+
+    // A new address space has no working set yet
+    for (int i = 0; i < SHADOW_WS_SIZE; i ++) {
+        ctx->ws[i].pa = 0;
+    }
+    ctx->ws_next = 0;
+    ctx->replay = false;
+
+    return victim;
+}
+
+struct switch_arg {
+    struct shadow_ctx *next;
+    struct host_batch batch;
+};
+
+// Keep mappings the next context has too, and unmap everything else
+static void switch_out_fn(struct shadow_state *sh, uintptr_t va, size_t size, uint64_t *ent, void *arg) {
+    struct switch_arg *a = (struct switch_arg *) arg;
+    if (! (*ent & SPTE_INSTALLED)) {
+        return;
+    }
+
+    int next_level;
+    uint64_t *next_ent = lookup_leaf(sh, a->next, va, &next_level);
+    if (next_ent && level_size(next_level) == size && spte_same(*next_ent, *ent)) {
+        *next_ent = spte_installed(*next_ent, spte_prot(*ent));
+        *ent &= ~ SPTE_INSTALLED;
+    } else {
+        unmap_leaf_fn(sh, va, size, ent, &a->batch);
+    }
+}
+
+// Map everything the next context has that is not mapped yet
+static void switch_in_fn(struct shadow_state *sh, uintptr_t va, size_t size, uint64_t *ent, void *arg) {
+    struct switch_arg *a = (struct switch_arg *) arg;
+    struct leaf_window w;
+    if ((*ent & SPTE_INSTALLED) || ! leaf_window(va, size, *ent, &w)) {
+        return;
+    }
+
+    int prot = host_prot(sh, *ent);
+    map_add(&a->batch, w.va, w.len, w.pa, prot);
+    if (has_holes(sh, &w, prot)) {
+        map_flush(&a->batch);
+        protect_holes(sh, &w, prot);
+    }
+    *ent = spte_installed(*ent, prot);
+}
+
+static void map_identity_ram() {
+    s_mmap(
+        (void *) RAM_START, RAM_SIZE,
+        PROT_READ | PROT_WRITE | PROT_EXEC,
+        MAP_SHARED | MAP_FIXED,
+        RAM_FD, 0
+    );
+    s_madvise((void *) RAM_START, RAM_SIZE, MADV_HUGEPAGE);
+}
+
+static void set_view(struct priv_state *priv, struct shadow_state *sh) {
+    sh->view_user = priv->priv_mode == PRIV_U;
+    sh->view_sum = get_sstatus_sum(priv->sstatus);
+    sh->view_mxr = get_sstatus_mxr(priv->sstatus);
+}
+
+void shadow_init(struct priv_state *priv) {
+    struct shadow_state *sh = get_shadow();
+
+    set_view(priv, sh);
+    sh->cur = -1;
+    sh->clock = 0;
+    sh->free_node = 0;
+    sh->vmas = STUB_VMAS;
+    sh->hand = 0;
+
+    // Node 0 means 'no node', so leave it out
+    for (uint32_t node = SHADOW_NODES - 1; node > 0; node --) {
+        sh->nodes[node].ent[0] = sh->free_node;
+        sh->free_node = node;
+    }
+}
+
+static bool eager_build(struct priv_state *priv, struct shadow_state *sh, int i);
+static void vma_check(struct priv_state *priv, struct shadow_state *sh, bool has_keep, uintptr_t keep);
+
+void shadow_switch(struct priv_state *priv, uintptr_t old_satp) {
+    struct shadow_state *sh = get_shadow();
+    bool old_bare = get_satp_mode(old_satp) == SATP_MODE_BARE;
+    bool new_bare = get_satp_mode(priv->satp) == SATP_MODE_BARE;
+
+    if (old_bare && new_bare) {
+        return;
+    }
+
+    priv->counter_satp_switch ++;
+    sh->clock ++;
+
+    if (old_bare) {
+        // Drop the identity mapping of RAM
+        s_munmap((void *) RAM_START, RAM_SIZE);
+    }
+
+    if (new_bare) {
+        if (sh->cur >= 0) {
+            unmap_ctx(sh, &sh->ctx[sh->cur]);
+            sh->cur = -1;
+        }
+
+        // We can't keep track of writes to page tables without translation
+        for (int i = 0; i < SHADOW_CTXS; i ++) {
+            sh->ctx[i].stale = true;
+        }
+        walk_cache_flush(priv);
+
+        // Nor keep patched code execute-only
+        patch_phys_access(priv, RAM_START, RAM_SIZE, false);
+
+        map_identity_ram();
+        return;
+    }
+
+    int next = find_ctx(sh, priv->satp);
+    if (next < 0) {
+        next = alloc_ctx(sh, priv->satp);
+    } else if (sh->ctx[next].stale) {
+        if (next == sh->cur) {
+            unmap_ctx(sh, &sh->ctx[next]);
+        }
+        forget_ctx(sh, next);
+    } else if (next != sh->cur) {
+        priv->counter_satp_reuse ++;
+    }
+
+    // Before switching out, so that pages the old address space has too
+    // can stay
+    if (sh->ctx[next].root == 0 && eager_build(priv, sh, next)) {
+        sh->ctx[next].replay = false;
+    }
+
+    struct switch_arg a = { .next = &sh->ctx[next], .batch = { .len = 0 } };
+
+    if (sh->cur >= 0 && sh->cur != next) {
+        for_each_leaf(sh, &sh->ctx[sh->cur], switch_out_fn, &a);
+        unmap_flush(&a.batch);
+    }
+
+    sh->cur = next;
+    sh->ctx[next].last_used = sh->clock;
+
+    for_each_leaf(sh, &sh->ctx[next], switch_in_fn, &a);
+    map_flush(&a.batch);
+
+    shadow_replay(priv);
+    vma_check(priv, sh, false, 0);
+}
+
+void shadow_clear_current(struct priv_state *priv) {
+    struct shadow_state *sh = get_shadow();
+
+    // Without translation there's nothing to clear
+    if (sh->cur >= 0) {
+        priv->counter_vm_flush ++;
+        unmap_ctx(sh, &sh->ctx[sh->cur]);
+        forget_ctx(sh, sh->cur);
+    }
+}
+
+struct reprotect_arg {
+    uintptr_t pa;
+};
+
+// Bring the host protection of the page at pa back in line with page_prot,
+// in every leaf that maps it
+static void reprotect_fn(struct shadow_state *sh, uintptr_t va, size_t size, uint64_t *ent, void *arg) {
+    struct reprotect_arg *a = (struct reprotect_arg *) arg;
+    uintptr_t pa = spte_pa(*ent);
+    int prot = spte_prot(*ent);
+
+    if ((*ent & SPTE_INSTALLED) && may_have_holes(prot) && a->pa >= pa && a->pa - pa < size) {
+        host_protect(va + (a->pa - pa), 4096, page_prot(sh, prot, a->pa));
+    }
+}
+
+static void reprotect_page(struct shadow_state *sh, uintptr_t pa) {
+    if (sh->cur >= 0) {
+        struct reprotect_arg a = { .pa = pa };
+        for_each_leaf(sh, &sh->ctx[sh->cur], reprotect_fn, &a);
+    }
+}
+
+void shadow_reprotect(struct priv_state *priv, uintptr_t pa) {
+    reprotect_page(get_shadow(), pa);
+}
+
+// Start watching writes to a page table page used by context i
+static void mark_pt(struct shadow_state *sh, int i, uintptr_t pa) {
+    uint8_t *ctxs = &sh->pt_ctxs[ram_page(pa)];
+    bool was_pt = *ctxs != 0;
+    *ctxs |= 1 << i;
+
+    if (! was_pt) {
+        reprotect_page(sh, pa);
+    }
+}
+
+// A page table page has been written to
+static void pt_written(struct priv_state *priv, struct shadow_state *sh, uintptr_t pa) {
+    uint8_t *ctxs = &sh->pt_ctxs[ram_page(pa)];
+
+    for (int i = 0; i < SHADOW_CTXS; i ++) {
+        if (*ctxs & (1 << i)) {
+            // The current context keeps using what it has until the next
+            // sfence.vma, like a TLB would
+            sh->ctx[i].stale = true;
+        }
+    }
+
+    *ctxs = 0;
+    priv->counter_pt_write ++;
+    walk_cache_flush(priv);
+    reprotect_page(sh, pa);
+}
+
+static uint64_t *insert_leaf_or_reclaim(struct shadow_state *sh, uintptr_t va, int level) {
+    uint64_t *ent = insert_leaf(sh, &sh->ctx[sh->cur], va, level);
+    if (ent) {
+        return ent;
+    }
+
+    // Out of nodes. Start by dropping the other contexts ...
+    for (int i = 0; i < SHADOW_CTXS; i ++) {
+        if (i != sh->cur) {
+            forget_ctx(sh, i);
+        }
+    }
+
+    ent = insert_leaf(sh, &sh->ctx[sh->cur], va, level);
+    if (ent) {
+        return ent;
+    }
+
+    // ... and if that's not enough, the current one too
+    unmap_ctx(sh, &sh->ctx[sh->cur]);
+    forget_ctx(sh, sh->cur);
+
+    return insert_leaf(sh, &sh->ctx[sh->cur], va, level);
+}
+
+// Host VMA budget
+
+struct count_arg {
+    size_t vmas;
+    uintptr_t end_va;       // Where the last leaf ended ...
+    uintptr_t end_pa;
+    int prot;               // ... and how it was mapped
+};
+
+// Count the host VMAs of the leaves of the current context. Adjacent leaves
+// mapped alike end up in the same VMA.
+static void count_fn(struct shadow_state *sh, uintptr_t va, size_t size, uint64_t *ent, void *arg) {
+    struct count_arg *a = (struct count_arg *) arg;
+    struct leaf_window w;
+    if (! (*ent & SPTE_INSTALLED) || ! leaf_window(va, size, *ent, &w)) {
+        return;
+    }
+
+    int prot = spte_prot(*ent);
+    if (a->vmas == 0 || w.va != a->end_va || w.pa != a->end_pa || prot != a->prot) {
+        a->vmas ++;
+    }
+
+    if (may_have_holes(prot)) {
+        for (uintptr_t off = 0; off < w.len; off += 4096) {
+            if (page_prot(sh, prot, w.pa + off) != prot) {
+                a->vmas += 2;
+            }
+        }
+    }
+
+    a->end_va = w.va + w.len;
+    a->end_pa = w.pa + w.len;
+    a->prot = prot;
+}
+
+static void vma_recount(struct priv_state *priv, struct shadow_state *sh) {
+    struct count_arg a = { .vmas = 0 };
+    for_each_leaf(sh, &sh->ctx[sh->cur], count_fn, &a);
+    sh->vmas = STUB_VMAS + a.vmas;
+}
+
+struct evict_arg {
+    struct priv_state *priv;
+    uintptr_t from;         // Only look at leaves from here on
+    bool has_keep;
+    uintptr_t keep;         // Never evict the leaf this is in
+    size_t want;            // Number of leaves still to evict
+    struct host_batch batch;
+};
+
+// Clock sweep. Leaves faulted in since the last sweep get another chance.
+static void evict_fn(struct shadow_state *sh, uintptr_t va, size_t size, uint64_t *ent, void *arg) {
+    struct evict_arg *a = (struct evict_arg *) arg;
+    if (! (*ent & SPTE_INSTALLED) || va < a->from || a->want == 0
+        || (a->has_keep && a->keep - va < size)) {
+        return;
+    }
+
+    if (*ent & SPTE_REF) {
+        *ent &= ~ SPTE_REF;
+        return;
+    }
+
+    unmap_leaf_fn(sh, va, size, ent, &a->batch);
+    *ent = 0;
+    a->want --;
+    a->priv->counter_vma_evict ++;
+    sh->hand = va + size;
+}
+
+// Keep the number of host VMAs within opts.vma_budget, by unmapping cold
+// leaves of the current context when it gets close
+static void vma_check(struct priv_state *priv, struct shadow_state *sh, bool has_keep, uintptr_t keep) {
+    size_t budget = priv->opts.vma_budget;
+
+    if (sh->vmas >= budget && sh->cur >= 0) {
+        vma_recount(priv, sh);
+
+        // Make some room if it really is close, so that we don't count again
+        // right away
+        size_t low = budget / 4 * 3;
+        for (int round = 0; round < 4 && sh->vmas >= budget / 8 * 7; round ++) {
+            struct evict_arg a = {
+                .priv = priv, .from = sh->hand,
+                .has_keep = has_keep, .keep = keep,
+                .want = sh->vmas - low,
+                .batch = { .len = 0 },
+            };
+
+            // From the hand to the end, then once more all the way through
+            for_each_leaf(sh, &sh->ctx[sh->cur], evict_fn, &a);
+            a.from = 0;
+            for_each_leaf(sh, &sh->ctx[sh->cur], evict_fn, &a);
+            unmap_flush(&a.batch);
+
+            if (a.want != 0) {
+                sh->hand = 0;
+            }
+
+            vma_recount(priv, sh);
+            if (sh->vmas <= low) {
+                break;
+            }
+        }
+    }
+
+    priv->counter_vmas = sh->vmas;
+}
+
+// Remember a 4 KiB page as part of the working set of ctx
+static void ws_add(struct shadow_ctx *ctx, uintptr_t va, uintptr_t pa) {
+    for (int i = 0; i < SHADOW_WS_SIZE; i ++) {
+        if (ctx->ws[i].pa != 0 && ctx->ws[i].va == va) {
+            ctx->ws[i].pa = pa;
+            return;
+        }
+    }
+
+    ctx->ws[ctx->ws_next].va = va;
+    ctx->ws[ctx->ws_next].pa = pa;
+    ctx->ws_next = (ctx->ws_next + 1) % SHADOW_WS_SIZE;
+}
+
+// Map a faulting 4 KiB page together with the pages next to it in the same
+// guest leaf page table, in the aligned window of opts.fault_around pages
+// around it. ent is the shadow leaf entry for va. Runs of contiguous pages
+// with the same protection go in with one mmap each.
+static void fault_around(struct priv_state *priv, struct shadow_state *sh, uintptr_t va, uint64_t *ent, const struct pt_walk *walk) {
+    size_t window = priv->opts.fault_around;
+    size_t index = va_index(va, 2);
+    size_t start = index - index % window;
+    size_t end = start + window > 512 ? 512 : start + window;
+
+    uint64_t *leaves = ent - index;
+    const uint64_t *guest = (const uint64_t *) ram_ptr(walk->pt[2]);
+    uintptr_t base_va = va & ~ (level_size(1) - 1);
+    uintptr_t stub_start = (uintptr_t) priv->stub_start;
+    uintptr_t stub_end = stub_start + priv->stub_size;
+    struct host_batch b = { .len = 0 };
+
+    for (size_t i = start; i < end; i ++) {
+        uint64_t pte = i == index ? walk->pte : guest[i];
+        uintptr_t page_va = base_va + (i << 12);
+        uintptr_t pa = spte_pa(pte);
+
+        if (i != index) {
+            // Only what the walker would take as a valid leaf, and nothing
+            // that's already there. Pages never accessed have to fault for
+            // the Accessed bit anyway.
+            uintptr_t flags = get_pte_flags(pte);
+            if (! (flags & PTE_V) || ! (flags & PTE_A)
+                || ! (flags & (PTE_R | PTE_X)) || ((flags & PTE_W) && ! (flags & PTE_R))
+                || ! is_ram_pa(pa) || (leaves[i] & SPTE_INSTALLED)
+                || (page_va >= stub_start && page_va < stub_end)) {
+                continue;
+            }
+            priv->counter_fault_around ++;
+        }
+
+        int prot = host_prot(sh, pte);
+        map_add(&b, page_va, 4096, pa, page_prot(sh, prot, pa));
+        leaves[i] = i == index ? spte_faulted(pte, prot) : spte_installed(pte, prot);
+    }
+
+    map_flush(&b);
+}
+
+static void map_fault(struct priv_state *priv, struct shadow_state *sh, uintptr_t va, uintptr_t scause, const struct pt_walk *walk) {
+    struct shadow_ctx *ctx = &sh->ctx[sh->cur];
+    int level = size_level(walk->page_size);
+    uintptr_t va_page = va & ~ 4095ul;
+    uintptr_t pa_page = walk->pa & ~ 4095ul;
+    struct leaf_window w;
+
+    int old_level;
+    uint64_t *ent = lookup_leaf(sh, ctx, va, &old_level);
+    if (ent && (*ent & SPTE_INSTALLED) && old_level == level && spte_same_ad(*ent, walk->pte)) {
+        if (scause != SCAUSE_INSTR_PF && patch_has_sites(pa_page)) {
+            // The guest is looking at or changing code we patched
+            patch_phys_access(priv, pa_page, 4096, scause == SCAUSE_LOAD_PF);
+            return;
+        }
+
+        // It's mapped already, but with less permissions than the guest
+        // allows, maybe because the Accessed or Dirty bit has just been set
+        if (! spte_same(*ent, walk->pte)) {
+            priv->counter_ad_fault ++;
+            *ent = spte_faulted(walk->pte, spte_prot(*ent));
+        }
+
+        int prot = host_prot(sh, *ent);
+        if (prot != spte_prot(*ent)) {
+            leaf_window(va & ~ (walk->page_size - 1), walk->page_size, *ent, &w);
+            host_protect(w.va, w.len, prot);
+            protect_holes(sh, &w, prot);
+            *ent = spte_faulted(*ent, prot);
+            return;
+        }
+
+        if (scause == SCAUSE_STORE_PF && (prot & PROT_WRITE)) {
+            *ent |= SPTE_REF;
+            if (is_pt_page(sh, pa_page)) {
+                pt_written(priv, sh, pa_page);
+            } else {
+                // A hole left over from a page that used to be a page table
+                // page of another context
+                host_protect(va_page, 4096, prot);
+            }
+            return;
+        }
+    }
+
+    // Not mapped yet, or the guest changed its page table without a
+    // sfence.vma. Go with the new translation.
+    struct host_batch b = { .len = 0 };
+    clear_slot(sh, ctx, va, level, &b);
+    unmap_flush(&b);
+
+    ent = insert_leaf_or_reclaim(sh, va, level);
+
+    for (int i = 0; i < walk->levels; i ++) {
+        mark_pt(sh, sh->cur, walk->pt[i]);
+    }
+
+    if (level == 2) {
+        ws_add(ctx, va_page, pa_page);
+    }
+
+    if (level == 2 && priv->opts.fault_around > 1) {
+        fault_around(priv, sh, va, ent, walk);
+        return;
+    }
+
+    // Map the whole superpage at once
+    int prot = host_prot(sh, walk->pte);
+    leaf_window(va & ~ (walk->page_size - 1), walk->page_size, walk->pte, &w);
+    host_map(w.va, w.len, w.pa, prot);
+    protect_holes(sh, &w, prot);
+    *ent = spte_faulted(walk->pte, prot);
+
+    if (level < 2) {
+        priv->counter_superpage ++;
+    }
+}
+
+void shadow_map_fault(struct priv_state *priv, uintptr_t va, uintptr_t scause, const struct pt_walk *walk) {
+    struct shadow_state *sh = get_shadow();
+    map_fault(priv, sh, va, scause, walk);
+    vma_check(priv, sh, true, va);
+}
+
+struct eager_arg {
+    struct priv_state *priv;
+    int ctx;
+    bool insert;        // Counting leaves if false, inserting them if true
+    size_t leaves;
+};
+
+// Go through a guest page table page at the given level, mapping the address
+// space from va. Returns false to stop, when there are too many leaves or
+// we're out of nodes.
+static bool eager_walk(struct shadow_state *sh, struct eager_arg *a, uintptr_t pt, int level, uintptr_t va) {
+    const uint64_t *table = (const uint64_t *) ram_ptr(pt);
+    uintptr_t stub_start = (uintptr_t) a->priv->stub_start;
+    uintptr_t stub_end = stub_start + a->priv->stub_size;
+
+    if (a->insert) {
+        mark_pt(sh, a->ctx, pt);
+    }
+
+    for (uintptr_t i = 0; i < 512; i ++) {
+        uint64_t pte = table[i];
+        uintptr_t flags = get_pte_flags(pte);
+        size_t size = level_size(level);
+        uintptr_t next_va = va | (i << (30 - 9 * level));
+        if (level == 0 && (i & 0x100)) {
+            // Sign extend
+            next_va |= ~ ((1ul << 39) - 1);
+        }
+
+        if (! (flags & PTE_V) || ((flags & PTE_W) && ! (flags & PTE_R))) {
+            continue;
+        }
+
+        if (! (flags & (PTE_R | PTE_X))) {
+            // Pointer to the next level
+            uintptr_t next_pt = spte_pa(pte);
+            if (level < 2 && is_ram_pa(next_pt) && ! eager_walk(sh, a, next_pt, level + 1, next_va)) {
+                return false;
+            }
+            continue;
+        }
+
+        // Only leaves the walker would take, that have been accessed, and
+        // that are at least partly in RAM and stay clear of the stub
+        struct leaf_window w;
+        if (! (flags & PTE_A) || (spte_pa(pte) & (size - 1))
+            || ! leaf_window(next_va, size, pte, &w)
+            || (w.va < stub_end && stub_start < w.va + w.len)) {
+            continue;
+        }
+
+        if (! a->insert) {
+            if (++ a->leaves > a->priv->opts.eager_leaves) {
+                return false;
+            }
+            continue;
+        }
+
+        uint64_t *ent = insert_leaf(sh, &sh->ctx[a->ctx], next_va, level);
+        if (ent == NULL) {
+            return false;
+        }
+        *ent = pte;
+    }
+
+    return true;
+}
+
+// Fill in the shadow page table of context i, which has no translations, from
+// the whole guest page table, if it has no more than opts.eager_leaves
+// leaves. The leaves are not installed yet. Returns false if eager building
+// is off or the address space is too big for it.
+static bool eager_build(struct priv_state *priv, struct shadow_state *sh, int i) {
+    if (priv->opts.eager_leaves == 0) {
+        return false;
+    }
+
+    uintptr_t root = get_satp_ppn(sh->ctx[i].satp) << 12;
+    if (! is_ram_pa(root)) {
+        return false;
+    }
+
+    struct eager_arg a = { .priv = priv, .ctx = i, .insert = false, .leaves = 0 };
+    if (! eager_walk(sh, &a, root, 0, 0)) {
+        priv->counter_eager_skip ++;
+        return false;
+    }
+
+    // If we run out of nodes, whatever is left faults in lazily
+    a.insert = true;
+    eager_walk(sh, &a, root, 0, 0);
+    priv->counter_eager_build ++;
+    return true;
+}
+
+void shadow_replay(struct priv_state *priv) {
+    struct shadow_state *sh = get_shadow();
+    if (sh->cur < 0 || ! sh->ctx[sh->cur].replay) {
+        return;
+    }
+
+    struct shadow_ctx *ctx = &sh->ctx[sh->cur];
+    ctx->replay = false;
+
+    if (ctx->root == 0 && eager_build(priv, sh, sh->cur)) {
+        struct switch_arg a = { .next = ctx, .batch = { .len = 0 } };
+        for_each_leaf(sh, ctx, switch_in_fn, &a);
+        map_flush(&a.batch);
+        vma_check(priv, sh, false, 0);
+        return;
+    }
+
+    // First walk everything, so that all page table pages are marked before
+    // we decide on host protections ...
+    uint64_t *ents[SHADOW_WS_SIZE];
+    uintptr_t vas[SHADOW_WS_SIZE];
+    int n = 0;
+
+    for (int i = 0; i < SHADOW_WS_SIZE; i ++) {
+        struct shadow_ws_entry *e = &ctx->ws[i];
+        if (e->pa == 0) {
+            continue;
+        }
+
+        struct pt_walk walk;
+        if (! lookup_walk(priv, e->va, &walk) || walk.pte == 0 || walk.page_size != 4096
+            || (walk.pa & ~ 4095ul) != e->pa || ! (get_pte_flags(walk.pte) & PTE_A)) {
+            // Not the same as when it was faulted in, so probably not part
+            // of the working set any more
+            priv->counter_replay_miss ++;
+            e->pa = 0;
+            continue;
+        }
+
+        int level;
+        uint64_t *ent = lookup_leaf(sh, ctx, e->va, &level);
+        if (ent && (*ent & SPTE_INSTALLED)) {
+            continue;
+        }
+
+        struct host_batch unmap = { .len = 0 };
+        clear_slot(sh, ctx, e->va, 2, &unmap);
+        unmap_flush(&unmap);
+
+        // Don't take nodes away from anything else for this
+        ent = insert_leaf(sh, ctx, e->va, 2);
+        if (ent == NULL) {
+            break;
+        }
+
+        for (int j = 0; j < walk.levels; j ++) {
+            mark_pt(sh, sh->cur, walk.pt[j]);
+        }
+
+        *ent = walk.pte;
+
+        // Keep them sorted by address, so that adjacent pages can be batched
+        int k = n ++;
+        for (; k > 0 && vas[k - 1] > e->va; k --) {
+            ents[k] = ents[k - 1];
+            vas[k] = vas[k - 1];
+        }
+        ents[k] = ent;
+        vas[k] = e->va;
+    }
+
+    // ... and then map it all
+    struct host_batch b = { .len = 0 };
+    for (int i = 0; i < n; i ++) {
+        uintptr_t pa = spte_pa(*ents[i]);
+        int prot = host_prot(sh, *ents[i]);
+        map_add(&b, vas[i], 4096, pa, page_prot(sh, prot, pa));
+        *ents[i] = spte_installed(*ents[i], prot);
+        priv->counter_replay_hit ++;
+    }
+    map_flush(&b);
+
+    vma_check(priv, sh, false, 0);
+}
+
+void shadow_phys_written(struct priv_state *priv, uintptr_t pa, size_t len) {
+    struct shadow_state *sh = get_shadow();
+
+    for (uintptr_t page = pa & ~ 4095ul; page < pa + len; page += 4096) {
+        if (is_pt_page(sh, page)) {
+            pt_written(priv, sh, page);
+        }
+    }
+}
+
+// Check the translation of one leaf of the current context against the guest
+// page table again
+static void revalidate_leaf(struct priv_state *priv, struct shadow_state *sh, uintptr_t va, int level, uint64_t *ent) {
+    size_t size = level_size(level);
+    struct leaf_window w;
+    struct pt_walk walk;
+
+    if (lookup_walk(priv, va, &walk) && walk.pte != 0
+        && walk.page_size == size && spte_pa(walk.pte) == spte_pa(*ent)) {
+
+        // Same page, maybe different permissions. No need to map it again.
+        for (int i = 0; i < walk.levels; i ++) {
+            mark_pt(sh, sh->cur, walk.pt[i]);
+        }
+
+        int prot = host_prot(sh, walk.pte);
+        if (prot != spte_prot(*ent) && leaf_window(va & ~ (size - 1), size, *ent, &w)) {
+            host_protect(w.va, w.len, prot);
+            protect_holes(sh, &w, prot);
+        }
+        *ent = spte_installed(walk.pte, prot);
+    } else {
+        struct host_batch b = { .len = 0 };
+        unmap_leaf_fn(sh, va & ~ (size - 1), size, ent, &b);
+        unmap_flush(&b);
+        *ent = 0;
+    }
+}
+
+void shadow_sfence_vma(struct priv_state *priv, bool all_va, uintptr_t va, bool all_asid, uintptr_t asid) {
+    struct shadow_state *sh = get_shadow();
+
+    for (int i = 0; i < SHADOW_CTXS; i ++) {
+        struct shadow_ctx *ctx = &sh->ctx[i];
+        if (ctx->satp == 0 || (! all_asid && get_satp_asid(ctx->satp) != asid)) {
+            continue;
+        }
+
+        if (all_va) {
+            // As long as no page table page has been written to, every
+            // translation we have is still good
+            if (ctx->stale) {
+                if (i == sh->cur) {
+                    shadow_clear_current(priv);
+                } else {
+                    forget_ctx(sh, i);
+                }
+            }
+        } else {
+            int level;
+            uint64_t *ent = lookup_leaf(sh, ctx, va, &level);
+            if (ent == NULL) {
+                continue;
+            }
+
+            if (*ent & SPTE_INSTALLED) {
+                revalidate_leaf(priv, sh, va, level, ent);
+            } else {
+                *ent = 0;
+            }
+        }
+    }
+}
+
+static void mode_changed_fn(struct shadow_state *sh, uintptr_t va, size_t size, uint64_t *ent, void *arg) {
+    struct host_batch *b = (struct host_batch *) arg;
+    struct leaf_window w;
+    if ((*ent & SPTE_INSTALLED) && leaf_window(va, size, *ent, &w)) {
+        int prot = host_prot(sh, *ent);
+        if (prot != spte_prot(*ent)) {
+            protect_add(b, w.va, w.len, prot);
+            if (has_holes(sh, &w, prot)) {
+                protect_flush(b);
+                protect_holes(sh, &w, prot);
+            }
+            *ent = spte_installed(*ent, prot);
+        }
+    }
+}
+
+void shadow_mode_changed(struct priv_state *priv) {
+    struct shadow_state *sh = get_shadow();
+    bool old_user = sh->view_user, old_sum = sh->view_sum, old_mxr = sh->view_mxr;
+
+    set_view(priv, sh);
+
+    if (sh->cur < 0
+        || (sh->view_user == old_user && sh->view_sum == old_sum && sh->view_mxr == old_mxr)) {
+        return;
+    }
+
+    priv->counter_mode_switch ++;
+
+    struct host_batch b = { .len = 0 };
+    for_each_leaf(sh, &sh->ctx[sh->cur], mode_changed_fn, &b);
+    protect_flush(&b);
+}
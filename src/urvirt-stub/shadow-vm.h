@@ -0,0 +1,150 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "riscv-priv.h"
+
+// Shadow page tables
+//
+// For every guest address space (identified by satp, including the ASID) we
+// have seen recently, we remember the translations we have installed on the
+// host, in a tree laid out like an Sv39 page table. Only the current address
+// space is actually mapped on the host. Switching satp only touches the pages
+// that differ between the two address spaces.
+//
+// The host mappings follow the guest privilege mode. Pages the guest may not
+// access in the current mode, like S-mode pages while in U-mode, stay mapped
+// with PROT_NONE, so a mode switch is a few mprotect calls rather than
+// unmapping everything and faulting it all back in.
+//
+// To know when the remembered translations go stale, every page table page
+// the walker went through is write-protected on the host. When the guest
+// writes to one, every address space that used it is marked stale and starts
+// afresh the next time it is switched to.
+//
+// When the translations of an address space are dropped, we keep a list of the
+// pages it faulted in most recently, its working set. Those are walked and
+// mapped again in one go before the guest runs in it again, rather than each
+// faulting back in.
+//
+// Every host mapping can take up a VMA on the host, and there can only be
+// vm.max_map_count of those. We keep an estimate of how many the current
+// address space uses, and when it goes over opts.vma_budget, leaves that
+// haven't been faulted in lately are unmapped again, clock style.
+//
+// Pages with patched instructions in them are mapped execute-only, see
+// patch.h. Like page table pages, they're holes in the leaves around them.
+//
+// Guest superpages are remembered as leaves at the same level as in the guest
+// page table, and mapped on the host in one go. Page table pages inside a
+// writable superpage are write-protected one 4 KiB page at a time.
+
+// Number of address spaces remembered
+#define SHADOW_CTXS 8
+
+// Number of 4 KiB nodes shadow page tables are allocated from
+#define SHADOW_NODES 256
+
+// Number of pages of guest RAM, RAM_SIZE / 4096
+#define SHADOW_RAM_PAGES 4096
+
+// Number of recently faulted in pages remembered for each address space
+#define SHADOW_WS_SIZE 32
+
+// Host VMAs of the stub itself, give or take
+#define STUB_VMAS 16
+
+// Entries of shadow page tables use the Sv39 PTE layout. A leaf entry is the
+// guest leaf PTE, at the same level. A non-leaf entry has the index of the
+// next node as its PPN. The stub keeps its own state in the high bits.
+
+// The entry is mapped on the host right now
+static const uint64_t SPTE_INSTALLED = 1ul << 63;
+
+// The entry has been faulted in since the last eviction sweep
+static const uint64_t SPTE_REF = 1ul << 62;
+
+// Protection flags the entry is mapped with on the host, not counting page
+// table pages write-protected inside it
+static const int SPTE_PROT_SHIFT = 56;
+static const uint64_t SPTE_PROT_MASK = 7ul << 56;
+
+struct shadow_node {
+    uint64_t ent[512];
+};
+
+struct shadow_ws_entry {
+    uintptr_t va;
+    uintptr_t pa;           // Where va was mapped to, 0 if the entry is unused
+};
+
+struct shadow_ctx {
+    uintptr_t satp;         // Guest satp, 0 if this slot is unused
+    uint32_t root;          // Node index of the root node
+    bool stale;             // A page table page has been written to
+    uintptr_t last_used;    // For picking a slot to reuse
+
+    // Working set, a ring of 4 KiB pages recently faulted in
+    struct shadow_ws_entry ws[SHADOW_WS_SIZE];
+    uint32_t ws_next;       // Entry of ws to use next
+    bool replay;            // Translations were dropped, map ws again
+};
+
+struct shadow_state {
+    struct shadow_node nodes[SHADOW_NODES];
+
+    struct shadow_ctx ctx[SHADOW_CTXS];
+    int cur;                // Current context, or -1 if translation is off
+
+    // What the host mappings are set up for
+    bool view_user;         // In U-mode
+    bool view_sum;          // sstatus.SUM
+    bool view_mxr;          // sstatus.MXR
+
+    uintptr_t clock;        // Ticks on every switch, for last_used
+    uint32_t free_node;     // Head of the list of free nodes
+
+    size_t vmas;            // Estimated number of host VMAs
+    uintptr_t hand;         // Where the next eviction sweep starts
+
+    // For each page of RAM, a bit mask of the contexts that have used it as
+    // a page table page
+    uint8_t pt_ctxs[SHADOW_RAM_PAGES];
+};
+
+void shadow_init(struct priv_state *priv);
+
+// Switch host mappings over to the address space in priv->satp, which used to
+// be old_satp
+void shadow_switch(struct priv_state *priv, uintptr_t old_satp);
+
+// The privilege mode, sstatus.SUM or sstatus.MXR may have changed. Update host
+// protection of the pages whose accessibility differs.
+void shadow_mode_changed(struct priv_state *priv);
+
+// Handle sfence.vma. Pages that only changed permissions are mprotect'ed,
+// other changed pages are unmapped.
+void shadow_sfence_vma(struct priv_state *priv, bool all_va, uintptr_t va, bool all_asid, uintptr_t asid);
+
+// Unmap everything of the current address space from the host, and forget
+// about it
+void shadow_clear_current(struct priv_state *priv);
+
+// Map the working set of the current address space again if its translations
+// have been dropped since it was last used. Pages the guest page table no
+// longer maps the same way are left alone.
+void shadow_replay(struct priv_state *priv);
+
+// Handle a page fault to a page of RAM the guest is allowed to access.
+// Either map the page, or in case the fault is because of write-protecting a
+// page table page, lift the protection.
+void shadow_map_fault(struct priv_state *priv, uintptr_t va, uintptr_t scause, const struct pt_walk *walk);
+
+// The host protection of the page at pa may have to change, because patches
+// went in or out of it
+void shadow_reprotect(struct priv_state *priv, uintptr_t pa);
+
+// The stub or an emulated device has written to guest physical memory
+void shadow_phys_written(struct priv_state *priv, uintptr_t pa, size_t len);
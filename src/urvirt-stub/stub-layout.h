@@ -0,0 +1,96 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "common.h"
+#include "riscv-priv.h"
+#include "shadow-vm.h"
+#include "patch.h"
+#include "block.h"
+#include "virtio-blk.h"
+
+// Memory owned by the stub, placed right after the stub image itself:
+//
+//     | stub image | signal stack | priv_state | RAM window | shadow_state | patch_state |
+//     | urvb_state | io_uring rings | vblk_state | overlay bitmap |
+//
+// All of it is inside [stub_start, stub_start + stub_size), so it survives
+// clearing the guest mappings, and the signal handler can find any of it
+// without making a system call.
+
+// Page aligned end of the stub image, see link.ld
+extern char stub_image_end[] __attribute__((visibility("hidden")));
+
+static inline void *get_sigstack() {
+    return stub_image_end;
+}
+
+static inline struct priv_state *get_priv() {
+    return (struct priv_state *) (stub_image_end + SIGSTACK_SIZE);
+}
+
+// The RAM window is a stub-private mapping of all of RAM_FD, so that guest
+// physical memory can be accessed directly
+static inline char *get_ram_window() {
+    return stub_image_end + SIGSTACK_SIZE + CONF_SIZE;
+}
+
+static inline bool is_ram_pa(uintptr_t pa) {
+    return pa >= RAM_START && pa < RAM_START + RAM_SIZE;
+}
+
+// Is all of [pa, pa + len) in RAM?
+static inline bool is_ram_range(uintptr_t pa, size_t len) {
+    return is_ram_pa(pa) && len <= RAM_START + RAM_SIZE - pa;
+}
+
+// Pointer into the RAM window for guest physical address pa, which must be in
+// RAM
+static inline void *ram_ptr(uintptr_t pa) {
+    return get_ram_window() + (pa - RAM_START);
+}
+
+static const size_t SHADOW_SIZE = (sizeof(struct shadow_state) + 4095) & ~ 4095;
+
+static inline struct shadow_state *get_shadow() {
+    return (struct shadow_state *) (get_ram_window() + RAM_SIZE);
+}
+
+static const size_t PATCH_SIZE = (sizeof(struct patch_state) + 4095) & ~ 4095;
+
+static inline struct patch_state *get_patch() {
+    return (struct patch_state *) ((char *) get_shadow() + SHADOW_SIZE);
+}
+
+static const size_t URVB_SIZE = (sizeof(struct urvb_state) + 4095) & ~ 4095;
+
+static inline struct urvb_state *get_urvb() {
+    return (struct urvb_state *) ((char *) get_patch() + PATCH_SIZE);
+}
+
+// A page each for the submission queue ring, the completion queue ring and
+// the SQEs, mapped from the io_uring
+static const size_t URVB_RING_SIZE = 3 * 4096;
+
+static inline char *get_urvb_rings() {
+    return (char *) get_urvb() + URVB_SIZE;
+}
+
+static const size_t VBLK_SIZE = (sizeof(struct vblk_state) + 4095) & ~ 4095;
+
+static inline struct vblk_state *get_vblk() {
+    return (struct vblk_state *) (get_urvb_rings() + URVB_RING_SIZE);
+}
+
+// Room for the bitmap of an overlay delta, mapped from DELTA_FD as far as
+// it's used. 1 MiB is enough for a 4 GiB base.
+static const size_t OVERLAY_BITMAP_SIZE = 1ul << 20;
+
+static inline void *get_overlay_bitmap() {
+    return (char *) get_vblk() + VBLK_SIZE;
+}
+
+// Number of bytes after the stub image that the stub takes up
+static const size_t STUB_DATA_SIZE = SIGSTACK_SIZE + CONF_SIZE + RAM_SIZE + SHADOW_SIZE + PATCH_SIZE
+    + URVB_SIZE + URVB_RING_SIZE + VBLK_SIZE + OVERLAY_BITMAP_SIZE;
@@ -11,6 +11,13 @@
 #include "handle-sbi.h"
 #include "riscv-priv.h"
 #include "riscv-bits.h"
+#include "stub-layout.h"
+#include "shadow-vm.h"
+#include "interp.h"
+#include "patch.h"
+#include "pv.h"
+#include "disk.h"
+#include "decode.h"
 #include "printf.h"
 
 void _putchar(char character) {
@@ -19,11 +26,13 @@ void _putchar(char character) {
 
 void handler(int sig, siginfo_t *info, void *ucontext_voidp) {
     ucontext_t *ucontext = (ucontext_t *) ucontext_voidp;
-    struct priv_state *priv = (struct priv_state *) s_mmap(
-        NULL, CONF_SIZE,
-        PROT_READ | PROT_WRITE, MAP_SHARED,
-        CONFIG_FD, 0
-    );
+    struct priv_state *priv = get_priv();
+    uintptr_t mode_before = priv->priv_mode;
+
+    pv_pull(priv);
+
+    // Async block commands that are done
+    urvb_poll(priv);
 
     if (sig == SIGSYS) {
         // ecall instruction
@@ -40,17 +49,82 @@ void handler(int sig, siginfo_t *info, void *ucontext_voidp) {
             printf("  sret = %zd\n", priv->counter_sret);
             printf("  uecall = %zd\n", priv->counter_uecall);
             printf("  secall = %zd\n", priv->counter_secall);
+            printf("  satp_switch = %zd\n", priv->counter_satp_switch);
+            printf("  satp_reuse = %zd\n", priv->counter_satp_reuse);
+            printf("  pt_write = %zd\n", priv->counter_pt_write);
+            printf("  sfence = %zd\n", priv->counter_sfence);
+            printf("  vm_flush = %zd\n", priv->counter_vm_flush);
+            printf("  mode_switch = %zd\n", priv->counter_mode_switch);
+            printf("  superpage = %zd\n", priv->counter_superpage);
+            printf("  fault_around = %zd\n", priv->counter_fault_around);
+            printf("  ad_fault = %zd\n", priv->counter_ad_fault);
+            printf("  replay_hit = %zd\n", priv->counter_replay_hit);
+            printf("  replay_miss = %zd\n", priv->counter_replay_miss);
+            printf("  eager_build = %zd\n", priv->counter_eager_build);
+            printf("  eager_skip = %zd\n", priv->counter_eager_skip);
+            printf("  vmas = %zd\n", priv->counter_vmas);
+            printf("  vma_evict = %zd\n", priv->counter_vma_evict);
+            printf("  walk_hit = %zd\n", priv->counter_walk_hit);
+            printf("  walk_miss = %zd\n", priv->counter_walk_miss);
+            printf("  run_instrs = %zd\n", priv->counter_run_instrs);
+            printf("  hot_runs = %zd\n", priv->counter_hot_runs);
+            printf("  patch_sites = %zd\n", priv->counter_patch_sites);
+            printf("  patch_revert = %zd\n", priv->counter_patch_revert);
+            printf("  patch_traps_avoided = %zd\n", patch_traps_avoided(priv));
+            printf("  pv_writes = %zd\n", priv->counter_pv_writes);
+            printf("  decode_hit = %zd\n", priv->counter_decode_hit);
+            printf("  decode_miss = %zd\n", priv->counter_decode_miss);
+            printf("  block_cmds = %zd\n", priv->counter_block_cmds);
+            printf("  block_syscalls = %zd\n", priv->counter_block_syscalls);
+            printf("  block_bytes = %zd\n", priv->counter_block_bytes);
+            printf("  block_async = %zd\n", priv->counter_block_async);
+            printf("  vblk_notify = %zd\n", priv->counter_vblk_notify);
+            printf("  vblk_reqs = %zd\n", priv->counter_vblk_reqs);
+            printf("  overlay_blocks = %zd\n", priv->counter_overlay_blocks);
+
+            // What each system call of the stub costs, which depends on how
+            // ecalls are trapped
+            uintptr_t start, end;
+            asm volatile ("csrr %0, time" : "=r"(start));
+            for (int i = 0; i < 256; i ++) {
+                s_getppid();
+            }
+            asm volatile ("csrr %0, time" : "=r"(end));
+            printf("  ecall mode = %s\n", priv->ecall_mode == ECALL_DISPATCH ? "dispatch" : "seccomp");
+            printf("  stub syscall ticks x 256 = %zd\n", end - start);
+            printf("  block copy = %s\n",
+                priv->block_copy == BLOCK_COPY_RANGE ? "copy_file_range"
+                : priv->block_copy == BLOCK_COPY_PREADV ? "preadv" : "auto, unused");
+            printf("  ramdisk = %s\n",
+                priv->opts.ramdisk == RAMDISK_WRITEBACK ? "writeback"
+                : priv->opts.ramdisk == RAMDISK_DISCARD ? "discard" : "off");
+            if (priv->counter_uecall) {
+                uintptr_t per_100 = priv->counter_segv * 100 / priv->counter_uecall;
+                printf("  segv per uecall = %zd.%02zd\n", per_100 / 100, per_100 % 100);
+                per_100 = priv->counter_ill * 100 / priv->counter_uecall;
+                printf("  sigill per uecall = %zd.%02zd\n", per_100 / 100, per_100 % 100);
+            }
+            if (priv->counter_ill) {
+                uintptr_t per_100 = (priv->counter_ill + priv->counter_run_instrs) * 100 / priv->counter_ill;
+                printf("  instrs per sigill = %zd.%02zd\n", per_100 / 100, per_100 % 100);
+            }
         }
 
         if (priv->priv_mode == PRIV_S) {
             priv->counter_secall ++;
 
-            // SBI call, only legacy ones for now
-            uintptr_t ret = handle_legacy_sbi_call(
-                priv, which, regs[10], regs[11], regs[12]
-            );
+            // SBI call, legacy ones and our own extension
+            if (which == SBI_EXT_URVIRT) {
+                struct sbiret ret = handle_urvirt_sbi_call(priv, regs[16]);
+                regs[10] = ret.error;
+                regs[11] = ret.value;
+            } else {
+                uintptr_t ret = handle_legacy_sbi_call(
+                    priv, which, regs[10], regs[11], regs[12]
+                );
 
-            regs[10] = ret;
+                regs[10] = ret;
+            }
         } else {
             priv->counter_uecall ++;
 
@@ -69,15 +143,22 @@ void handler(int sig, siginfo_t *info, void *ucontext_voidp) {
             // Illegal instruction in S-mode
             // Maybe emulate privileged instruction?
 
-            char *pc = (char *) ucontext->uc_mcontext.__gregs[0];
-            // Check first byte of instruction
+            uintptr_t pc = ucontext->uc_mcontext.__gregs[0];
+            uint32_t instr;
             // 32-bit insns: last 2 bits are 11, but last 5 bits are not 11111
-            if (((*pc) & 0b11) == 0b11 && ((*pc) & 0b11111) != 0b11111) {
+            if (! fetch_instr(priv, pc, &instr)) {
+                // The guest's page tables no longer map it
+                enter_trap(priv, ucontext, SCAUSE_INSTR_PF, pc);
+            } else if ((instr & 0b11) == 0b11 && (instr & 0b11111) != 0b11111) {
                 // 32-bit instruction
-                uint32_t instr = *(uint32_t *) pc;
+                uintptr_t traps = count_trap(priv, pc);
                 handle_priv_instr(priv, ucontext, instr);
+                if (priv->opts.patch_after != 0 && traps >= priv->opts.patch_after) {
+                    patch_csr(priv, pc, instr);
+                }
+                emulate_run(priv, ucontext, traps);
             } else {
-                printf("Can't handle in SIGILL at %p\n", pc);
+                printf("Can't handle in SIGILL at 0x%zx\n", pc);
                 asm("ebreak");
             }
         } else {
@@ -91,48 +172,33 @@ void handler(int sig, siginfo_t *info, void *ucontext_voidp) {
             write_log("timer in u mode");
         }
 
+    } else if (sig == SIGIO) {
+        // The block device's io_uring has completions, they were picked up
+        // by urvb_poll
+
     } else if (sig == SIGSEGV) {
         priv->counter_segv ++;
 
         uintptr_t scause;
         char *pc = (char *) ucontext->uc_mcontext.__gregs[0];
+        uintptr_t addr = (uintptr_t)(info->si_addr);
+        uint32_t instr;
 
         if (info->si_addr == pc) {
             // TODO: Handle case of load/store current instruction
             scause = SCAUSE_INSTR_PF;
+        } else if (! fetch_instr(priv, (uintptr_t) pc, &instr)) {
+            // Not mapped in the guest's page tables any more, which is what
+            // fetching it again would find
+            scause = SCAUSE_INSTR_PF;
+            addr = (uintptr_t) pc;
         } else {
-            if (((*pc) & 0b11) != 0b11) {
-                uint16_t instr = *((uint16_t *) pc);
-
-                // FIXME: Refactor this instruction detection logic
-                if (rvc_looks_like_load(instr)) {
-                    scause = SCAUSE_LOAD_PF;
-                } else if (rvc_looks_like_store(instr)) {
-                    scause = SCAUSE_STORE_PF;
-                } else {
-                    scause = SCAUSE_INSTR_PF;
-                    write_log("weird 16-bit instruction page fault, assuming instr page fault");
-                    // asm("ebreak");
-                }
-
-            } else {
-                uint32_t instr = *((uint32_t *) pc);
-
-                char opcode = (*pc) & 0b1111111;
-                if (opcode == OPCODE_LOAD) {
-                    scause = SCAUSE_LOAD_PF;
-                } else if (opcode == OPCODE_STORE) {
-                    scause = SCAUSE_STORE_PF;
-                } else if (opcode == OPCODE_AMO) {
-                    scause = SCAUSE_STORE_PF;
-                } else {
-                    scause = SCAUSE_INSTR_PF;
-                    write_log("weird 32-bit instruction page fault, assuming instr page fault");
-                }
+            scause = mem_insn_scause(decode_mem(priv, (uintptr_t) pc, instr));
+            if (scause == SCAUSE_INSTR_PF) {
+                write_log("weird instruction page fault, assuming instr page fault");
             }
         }
 
-        uintptr_t addr = (uintptr_t)(info->si_addr);
         handle_page_fault(priv, ucontext, scause, addr);
     } else {
         write_log("Don't know how to handle");
@@ -141,22 +207,17 @@ void handler(int sig, siginfo_t *info, void *ucontext_voidp) {
 
     // Handle interrupt traps
 
-    if (get_six_sti(priv->sip)
-        && get_six_sti(priv->sie)
-        && (get_sstatus_sie(priv->sstatus) || priv->priv_mode < PRIV_S)) {
-        write_log("timer interrupt taken");
-        enter_trap(priv, ucontext, SCAUSE_TIMER, 0);
+    uintptr_t interrupt = pending_interrupt(priv);
+    if (interrupt != 0) {
+        write_log("interrupt taken");
+        enter_trap(priv, ucontext, interrupt, 0);
     }
 
-    if (priv->should_clear_vm) {
-        priv->should_clear_vm = 0;
-        size_t safe_begin = (size_t) priv->stub_start;
-        size_t safe_end = (size_t) priv->stub_start + priv->stub_size;
-        s_munmap((void *) 0, safe_begin);
-        s_munmap((void *) safe_end, (1ull << 38) - safe_end);
+    if (mode_before == PRIV_U && priv->priv_mode == PRIV_S) {
+        emulate_trap_entry(priv, ucontext);
     }
 
-    s_munmap(priv, CONF_SIZE);
+    pv_push(priv);
 }
 
 __attribute__((naked)) void handler_wrapper(int sig, siginfo_t *info, void *ucontext_voidp) {
@@ -179,6 +240,48 @@ __attribute__((naked)) void handler_wrapper(int sig, siginfo_t *info, void *ucon
     );
 }
 
+// Make the guest's ecall instructions raise SIGSYS, and return how.
+//
+// With syscall user dispatch, system calls from the stub's range are let
+// through without running anything, while a Seccomp filter runs on every
+// system call, including all of the stub's own. But on riscv, syscall user
+// dispatch only came with the move to generic entry, in Linux 6.1 or so.
+static int trap_ecalls(struct priv_state *priv) {
+    uintptr_t start = (uintptr_t) priv->stub_start;
+    uintptr_t size = priv->stub_size;
+
+    if (priv->opts.ecall_mode != ECALL_SECCOMP) {
+        // All of the stub, including the signal handler and its
+        // rt_sigreturn, is in the allowed range. So the selector can say
+        // BLOCK for good, and the handler never has to flip it.
+        priv->sud_selector = SYSCALL_DISPATCH_FILTER_BLOCK;
+        int ret = s_prctl(PR_SET_SYSCALL_USER_DISPATCH, PR_SYS_DISPATCH_ON,
+            start, size, (unsigned long) &priv->sud_selector);
+        if (ret == 0) {
+            return ECALL_DISPATCH;
+        }
+
+        if (priv->opts.ecall_mode == ECALL_DISPATCH) {
+            write_log("Syscall user dispatch is not available");
+            s_exit_group(1);
+        }
+    }
+
+    struct sock_fprog prog;
+    struct sock_filter filt[32];
+    prog.filter = filt;
+    prog.len = gen_addr_filter(start, start + size, filt);
+
+    s_prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0);
+    int ret = s_seccomp(SECCOMP_SET_MODE_FILTER, 0, &prog);
+
+    if (ret < 0) {
+        s_exit_group(1);
+    }
+
+    return ECALL_SECCOMP;
+}
+
 void entrypoint_1(void *sigstack_start, struct urvirt_config *conf) {
     // Set stdin to non-blocking
     s_fcntl(STDIN_FILENO, F_SETFL, O_NONBLOCK);
@@ -198,12 +301,13 @@ void entrypoint_1(void *sigstack_start, struct urvirt_config *conf) {
         *ptr = 0;
     }
 
-    sa.sa_mask.__bits[0] |= (1 << (SIGALRM - 1));
+    sa.sa_mask.__bits[0] |= (1 << (SIGALRM - 1)) | (1 << (SIGIO - 1));
 
     s_rt_sigaction(SIGILL, &sa, NULL);
     s_rt_sigaction(SIGSYS, &sa, NULL);
     s_rt_sigaction(SIGALRM, &sa, NULL);
     s_rt_sigaction(SIGSEGV, &sa, NULL);
+    s_rt_sigaction(SIGIO, &sa, NULL);
 
     // Set up timer to cause SIGALRM when elapses
 
@@ -225,6 +329,52 @@ void entrypoint_1(void *sigstack_start, struct urvirt_config *conf) {
         RAM_FD, 0
     );
 
+    // The stub's own view of RAM, which stays there for good
+
+    s_mmap(
+        get_ram_window(), RAM_SIZE,
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_FIXED,
+        RAM_FD, 0
+    );
+    s_madvise(get_ram_window(), RAM_SIZE, MADV_HUGEPAGE);
+
+    // Shadow page tables
+
+    s_mmap(
+        get_shadow(), SHADOW_SIZE,
+        PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED,
+        -1, 0
+    );
+
+    // Patched instruction bookkeeping
+
+    s_mmap(
+        get_patch(), PATCH_SIZE,
+        PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED,
+        -1, 0
+    );
+
+    // Block device state, the io_uring rings go after it in urvb_init
+
+    s_mmap(
+        get_urvb(), URVB_SIZE,
+        PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED,
+        -1, 0
+    );
+
+    // virtio-blk device state
+
+    s_mmap(
+        get_vblk(), VBLK_SIZE,
+        PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED,
+        -1, 0
+    );
+
     // Copy the kernel to RAM
 
     size_t kernel_size_pg = (conf->kernel_size + 4095) & (~ 4095);
@@ -236,26 +386,13 @@ void entrypoint_1(void *sigstack_start, struct urvirt_config *conf) {
         KERNEL_FD, 0
     );
 
+    char *kernel_dest = ram_ptr(KERNEL_START);
     for (size_t i = 0; i < conf->kernel_size; i ++) {
-        ((char *) KERNEL_START)[i] = kernel[i];
+        kernel_dest[i] = kernel[i];
     }
 
     s_riscv_flush_icache(0, 0, 0);
 
-    // Set up and enable Seccomp filters
-
-    struct sock_fprog prog;
-    struct sock_filter filt[32];
-    prog.filter = filt;
-    prog.len = gen_addr_filter((size_t) (conf->stub_start), (size_t) (conf->stub_start + conf->stub_size), filt);
-
-    s_prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0);
-    int ret = s_seccomp(SECCOMP_SET_MODE_FILTER, 0, &prog);
-
-    if (ret < 0) {
-        s_exit_group(1);
-    }
-
     s_munmap(kernel, kernel_size_pg);
 
     // Initialize priv_state
@@ -263,9 +400,15 @@ void entrypoint_1(void *sigstack_start, struct urvirt_config *conf) {
     struct priv_state *priv = (struct priv_state *) conf;
     initialize_priv(priv);
     priv->timerid = timerid;
+    shadow_init(priv);
+    patch_init(priv);
+    disk_init(priv);
+    urvb_init(priv);
+    vblk_init(priv);
 
-    // Unmap everything that's not the kernel and not the stub
-    s_munmap(conf, CONF_SIZE);
+    // Trap guest ecalls from now on
+
+    priv->ecall_mode = trap_ecalls(priv);
 
     // Here we go
     write_log("Jumping to kernel ...");
@@ -306,24 +449,30 @@ void entrypoint() {
 
     void *kernel_end = conf->stub_start + conf->stub_size;
 
+    if (kernel_end != get_sigstack()) {
+        // The loader did not map the whole stub image
+        s_exit_group(1);
+    }
+
     s_munmap((void *) (conf->stub_start + conf->stub_size), (1ull << 38) - ((size_t) conf->stub_start + conf->stub_size));
     s_munmap((void *) conf, CONF_SIZE);
 
     // Set up the stack to use, as well as the stack the later part of the initialization needs
     void *sigstack_start = s_mmap(
-        kernel_end, SIGSTACK_SIZE,
+        get_sigstack(), SIGSTACK_SIZE,
         PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK | MAP_FIXED,
         -1, 0
     );
 
-
+    // The configuration becomes priv_state later on. It stays mapped right
+    // after the stack from now on, so the signal handler need not map it.
     struct urvirt_config *conf_to_entrypoint_1 = (struct urvirt_config *) s_mmap(
-        NULL, CONF_SIZE,
-        PROT_READ | PROT_WRITE, MAP_SHARED,
+        get_priv(), CONF_SIZE,
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
         CONFIG_FD, 0
     );
 
-    conf_to_entrypoint_1->stub_size += SIGSTACK_SIZE;
+    conf_to_entrypoint_1->stub_size += STUB_DATA_SIZE;
 
     // We have another stack now, jump to another function to use it
 
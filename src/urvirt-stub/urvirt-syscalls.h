@@ -5,6 +5,8 @@
 #include <signal.h>
 #include <time.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
 
 #include "internal-syscall.h"
 
@@ -38,6 +40,14 @@ inline void *s_mmap(void *addr, size_t length, int prot, int flags, int fd, off_
     return (void *) internal_syscall(SYS_mmap, 6, (uintptr_t) addr, (uintptr_t) length, (uintptr_t) prot, (uintptr_t) flags, (uintptr_t) fd, (uintptr_t) pgoffset);
 }
 
+inline int s_mprotect(void *addr, size_t length, int prot) {
+    return (int) internal_syscall(SYS_mprotect, 3, (uintptr_t) addr, (uintptr_t) length, (uintptr_t) prot, /* ... */ 0, 0, 0);
+}
+
+inline int s_madvise(void *addr, size_t length, int advice) {
+    return (int) internal_syscall(SYS_madvise, 3, (uintptr_t) addr, (uintptr_t) length, (uintptr_t) advice, /* ... */ 0, 0, 0);
+}
+
 inline int s_sigaltstack(const stack_t * ss, stack_t * oss) {
     return (int) internal_syscall(SYS_sigaltstack, 2, (uintptr_t) ss, (uintptr_t) oss, /* ... */ 0, 0, 0, 0);
 }
@@ -84,8 +94,53 @@ inline ssize_t s_pwrite64(int fd, const void *buf, size_t count, off_t offset) {
     return internal_syscall(SYS_pwrite64, 4, (uintptr_t) fd, (uintptr_t) buf, (uintptr_t) count, (uintptr_t) offset, /* ... */ 0, 0);
 }
 
+// The offset is split in two halves for 32-bit hosts, the second one is 0 here
+inline ssize_t s_preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset) {
+    return internal_syscall(SYS_preadv, 5, (uintptr_t) fd, (uintptr_t) iov, (uintptr_t) iovcnt, (uintptr_t) offset, 0, /* ... */ 0);
+}
+
+inline ssize_t s_pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset) {
+    return internal_syscall(SYS_pwritev, 5, (uintptr_t) fd, (uintptr_t) iov, (uintptr_t) iovcnt, (uintptr_t) offset, 0, /* ... */ 0);
+}
+
+inline off_t s_lseek(int fd, off_t offset, int whence) {
+    return internal_syscall(SYS_lseek, 3, (uintptr_t) fd, (uintptr_t) offset, (uintptr_t) whence, /* ... */ 0, 0, 0);
+}
+
+inline int s_fdatasync(int fd) {
+    return (int) internal_syscall(SYS_fdatasync, 1, (uintptr_t) fd, /* ... */ 0, 0, 0, 0, 0);
+}
+
+inline ssize_t s_copy_file_range(int fd_in, off_t *off_in, int fd_out, off_t *off_out, size_t len, unsigned flags) {
+    return internal_syscall(SYS_copy_file_range, 6, (uintptr_t) fd_in, (uintptr_t) off_in, (uintptr_t) fd_out, (uintptr_t) off_out, (uintptr_t) len, (uintptr_t) flags);
+}
+
+inline ssize_t s_sendfile(int out_fd, int in_fd, off_t *offset, size_t count) {
+    return internal_syscall(SYS_sendfile, 4, (uintptr_t) out_fd, (uintptr_t) in_fd, (uintptr_t) offset, (uintptr_t) count, /* ... */ 0, 0);
+}
+
 inline ssize_t s_prctl(int option, unsigned long arg2, unsigned long arg3, unsigned long arg4, unsigned long arg5) {
     return internal_syscall(SYS_prctl, 5, (uintptr_t) option, (uintptr_t) arg2, (uintptr_t) arg3, (uintptr_t) arg4, (uintptr_t) arg5, /* ... */ 0);
 }
 
+inline pid_t s_getppid() {
+    return (pid_t) internal_syscall(SYS_getppid, 0, /* ... */ 0, 0, 0, 0, 0, 0);
+}
+
+inline pid_t s_getpid() {
+    return (pid_t) internal_syscall(SYS_getpid, 0, /* ... */ 0, 0, 0, 0, 0, 0);
+}
+
+inline int s_pipe2(int pipefd[2], int flags) {
+    return (int) internal_syscall(SYS_pipe2, 2, (uintptr_t) pipefd, (uintptr_t) flags, /* ... */ 0, 0, 0, 0);
+}
+
+inline int s_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int) internal_syscall(SYS_io_uring_setup, 2, (uintptr_t) entries, (uintptr_t) p, /* ... */ 0, 0, 0, 0);
+}
+
+inline int s_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int) internal_syscall(SYS_io_uring_enter, 6, (uintptr_t) fd, (uintptr_t) to_submit, (uintptr_t) min_complete, (uintptr_t) flags, 0, 0);
+}
+
 #define write_log(str) do { s_write(2, "[urvirt] " str "\n", sizeof("[urvirt] " str "\n") - 1); } while(0)
@@ -0,0 +1,376 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/uio.h>
+#include <linux/virtio_blk.h>
+#include <linux/virtio_config.h>
+#include <linux/virtio_ids.h>
+#include <linux/virtio_mmio.h>
+#include <linux/virtio_ring.h>
+
+#include "virtio-blk.h"
+#include "disk.h"
+#include "riscv-bits.h"
+#include "stub-layout.h"
+#include "shadow-vm.h"
+#include "patch.h"
+#include "printf.h"
+
+#include "urvirt-syscalls.h"
+
+// "URVT"
+static const uint32_t VBLK_VENDOR_ID = 0x54565255;
+
+static const uint64_t VBLK_FEATURES =
+    (1ull << VIRTIO_F_VERSION_1)
+    | (1ull << VIRTIO_RING_F_INDIRECT_DESC)
+    | (1ull << VIRTIO_RING_F_EVENT_IDX)
+    | (1ull << VIRTIO_BLK_F_SEG_MAX)
+    | (1ull << VIRTIO_BLK_F_BLK_SIZE)
+    | (1ull << VIRTIO_BLK_F_FLUSH);
+
+static const char VBLK_ID[] = "urvirt";
+
+static inline uintptr_t iov_pa(const struct iovec *iov) {
+    return (char *) iov->iov_base - get_ram_window() + RAM_START;
+}
+
+static bool has_feature(struct vblk_state *v, int bit) {
+    return (v->driver_features & (1ull << bit)) != 0;
+}
+
+static void reset(struct priv_state *priv, struct vblk_state *v) {
+    v->status = 0;
+    v->device_features_sel = 0;
+    v->driver_features_sel = 0;
+    v->driver_features = 0;
+    v->queue_sel = 0;
+    v->interrupt_status = 0;
+    v->queue_num = URVIRT_VIRTIO_QUEUE_MAX;
+    v->queue_ready = false;
+    v->queue_desc = 0;
+    v->queue_avail = 0;
+    v->queue_used = 0;
+    v->last_avail = 0;
+    v->used_idx = 0;
+    set_external_irq(priv, EXT_IRQ_VBLK, false);
+}
+
+void vblk_init(struct priv_state *priv) {
+    struct vblk_state *v = get_vblk();
+    reset(priv, v);
+
+    char *config = (char *) &v->config;
+    for (size_t i = 0; i < sizeof(v->config); i ++) {
+        config[i] = 0;
+    }
+    off_t size = disk_size(priv);
+    v->config.capacity = size > 0 ? size / 512 : 0;
+    v->config.seg_max = URVIRT_VIRTIO_SEG_MAX;
+    v->config.blk_size = 512;
+}
+
+// Check the queue the driver set up, and turn it on
+static void queue_ready(struct vblk_state *v) {
+    uint32_t num = v->queue_num;
+
+    if (num == 0 || num > URVIRT_VIRTIO_QUEUE_MAX || (num & (num - 1)) != 0
+        || (v->queue_desc & 15) != 0 || (v->queue_avail & 1) != 0 || (v->queue_used & 3) != 0
+        || ! is_ram_range(v->queue_desc, num * sizeof(struct vring_desc))
+        || ! is_ram_range(v->queue_avail, 6 + 2 * num)
+        || ! is_ram_range(v->queue_used, 6 + 8 * num)) {
+        printf("[urvirt] virtio-blk queue of %u at 0x%zx is bad\n", num, (size_t) v->queue_desc);
+        v->status |= VIRTIO_CONFIG_S_NEEDS_RESET;
+        return;
+    }
+    v->queue_ready = true;
+}
+
+// Walk the descriptor chain from head into v->iov. Returns how many buffers
+// there are, or -1 if the chain is bad.
+static int gather(struct vblk_state *v, uint16_t head) {
+    struct vring_desc *table = ram_ptr(v->queue_desc);
+    uint32_t num = v->queue_num;
+    uint32_t i = head;
+    uint32_t steps = 0;
+    bool indirect = false;
+    int n = 0;
+
+    for (;;) {
+        // Each descriptor once at most, so a loop in the chain ends
+        if (i >= num || steps ++ >= num) {
+            return -1;
+        }
+
+        struct vring_desc *d = &table[i];
+        if (d->flags & VRING_DESC_F_INDIRECT) {
+            if (indirect || ! has_feature(v, VIRTIO_RING_F_INDIRECT_DESC)
+                || d->len == 0 || d->len % sizeof(struct vring_desc) != 0
+                || (d->addr & 15) != 0 || ! is_ram_range(d->addr, d->len)) {
+                return -1;
+            }
+            table = ram_ptr(d->addr);
+            num = d->len / sizeof(struct vring_desc);
+            i = 0;
+            steps = 0;
+            indirect = true;
+            continue;
+        }
+
+        if (n == URVIRT_VIRTIO_SEG_MAX + 2 || ! is_ram_range(d->addr, d->len)) {
+            return -1;
+        }
+        v->iov[n].iov_base = ram_ptr(d->addr);
+        v->iov[n].iov_len = d->len;
+        n ++;
+
+        if (! (d->flags & VRING_DESC_F_NEXT)) {
+            return n;
+        }
+        i = d->next;
+    }
+}
+
+// Do the request at head, returning the bytes written to its buffers
+static uint32_t request(struct priv_state *priv, struct vblk_state *v, uint16_t head) {
+    const size_t hdr_len = sizeof(struct virtio_blk_outhdr);
+    int n = gather(v, head);
+
+    if (n < 1 || v->iov[0].iov_len < hdr_len || v->iov[n - 1].iov_len < (n == 1 ? hdr_len + 1 : 1)) {
+        printf("[urvirt] virtio-blk request at %u is bad\n", head);
+        return 0;
+    }
+
+    struct virtio_blk_outhdr *hdr = v->iov[0].iov_base;
+    uint32_t type = hdr->type;
+    uint64_t sector = hdr->sector;
+    v->iov[0].iov_base = (char *) v->iov[0].iov_base + hdr_len;
+    v->iov[0].iov_len -= hdr_len;
+
+    v->iov[n - 1].iov_len -= 1;
+    uint8_t *status = (uint8_t *) v->iov[n - 1].iov_base + v->iov[n - 1].iov_len;
+
+    size_t len = 0;
+    for (int i = 0; i < n; i ++) {
+        len += v->iov[i].iov_len;
+
+        // Never patched code to the disk, or over it
+        patch_phys_access(priv, iov_pa(&v->iov[i]), v->iov[i].iov_len, false);
+    }
+
+    uint32_t written = 0;
+    *status = VIRTIO_BLK_S_OK;
+
+    if (type == VIRTIO_BLK_T_OUT && len % 512 != 0) {
+        // Whole sectors only, as the overlay can't do less, see disk.h
+        printf("[urvirt] virtio-blk write of %zd bytes is not whole sectors\n", len);
+        *status = VIRTIO_BLK_S_IOERR;
+    } else if ((type == VIRTIO_BLK_T_IN || type == VIRTIO_BLK_T_OUT)
+        && (sector > v->config.capacity || (len + 511) / 512 > v->config.capacity - sector)) {
+        // Writing past the end would make the image, the RAM disk or the
+        // overlay delta grow
+        printf("[urvirt] virtio-blk transfer of %zd bytes at sector %zd is past the end\n", len, (size_t) sector);
+        *status = VIRTIO_BLK_S_IOERR;
+    } else if (type == VIRTIO_BLK_T_IN || type == VIRTIO_BLK_T_OUT) {
+        off_t offset = sector * 512;
+        ssize_t res = type == VIRTIO_BLK_T_OUT
+            ? disk_pwritev(priv, v->iov, n, offset)
+            : disk_preadv(priv, v->iov, n, offset);
+        if (res != (ssize_t) len) {
+            printf("[urvirt] virtio-blk transfer of %zd bytes at %zd did %zd\n", len, offset, res);
+            *status = VIRTIO_BLK_S_IOERR;
+        }
+        priv->counter_block_syscalls ++;
+        priv->counter_block_bytes += len;
+
+        if (type == VIRTIO_BLK_T_IN) {
+            for (int i = 0; i < n; i ++) {
+                shadow_phys_written(priv, iov_pa(&v->iov[i]), v->iov[i].iov_len);
+            }
+            written = len;
+        }
+    } else if (type == VIRTIO_BLK_T_FLUSH) {
+        if (disk_sync(priv) != 0) {
+            *status = VIRTIO_BLK_S_IOERR;
+        }
+    } else if (type == VIRTIO_BLK_T_GET_ID) {
+        // Padded with zeros to VIRTIO_BLK_ID_BYTES, or cut short
+        size_t done = 0;
+        for (int i = 0; i < n && done < VIRTIO_BLK_ID_BYTES; i ++) {
+            char *p = v->iov[i].iov_base;
+            for (size_t j = 0; j < v->iov[i].iov_len && done < VIRTIO_BLK_ID_BYTES; j ++, done ++) {
+                p[j] = done < sizeof(VBLK_ID) ? VBLK_ID[done] : 0;
+            }
+            shadow_phys_written(priv, iov_pa(&v->iov[i]), v->iov[i].iov_len);
+        }
+        written = done;
+    } else {
+        *status = VIRTIO_BLK_S_UNSUPP;
+    }
+
+    uintptr_t status_pa = iov_pa(&v->iov[n - 1]) + v->iov[n - 1].iov_len;
+    shadow_phys_written(priv, status_pa, 1);
+    priv->counter_vblk_reqs ++;
+    return written + 1;
+}
+
+// Take everything on the avail ring
+static void notify(struct priv_state *priv, struct vblk_state *v) {
+    struct vring_avail *avail = ram_ptr(v->queue_avail);
+    struct vring_used *used = ram_ptr(v->queue_used);
+    uint32_t num = v->queue_num;
+    uint16_t old_used = v->used_idx;
+
+    priv->counter_vblk_notify ++;
+
+    uint16_t avail_idx = __atomic_load_n(&avail->idx, __ATOMIC_ACQUIRE);
+    if ((uint16_t) (avail_idx - v->last_avail) > num) {
+        printf("[urvirt] virtio-blk avail idx %u is %u ahead\n", avail_idx, (uint16_t) (avail_idx - v->last_avail));
+        v->status |= VIRTIO_CONFIG_S_NEEDS_RESET;
+        return;
+    }
+
+    for (; v->last_avail != avail_idx; v->last_avail ++) {
+        uint16_t head = avail->ring[v->last_avail % num];
+        struct vring_used_elem *elem = &used->ring[v->used_idx % num];
+        elem->len = request(priv, v, head);
+        elem->id = head;
+        v->used_idx ++;
+    }
+
+    bool event_idx = has_feature(v, VIRTIO_RING_F_EVENT_IDX);
+    if (event_idx) {
+        // avail_event, right after the used ring: tell us about the next one
+        *(uint16_t *) &used->ring[num] = v->last_avail;
+    }
+    __atomic_store_n(&used->idx, v->used_idx, __ATOMIC_RELEASE);
+    shadow_phys_written(priv, v->queue_used, 6 + 8 * num);
+
+    bool interrupt;
+    if (v->used_idx == old_used) {
+        interrupt = false;
+    } else if (event_idx) {
+        // used_event, right after the avail ring
+        interrupt = vring_need_event(avail->ring[num], v->used_idx, old_used);
+    } else {
+        interrupt = ! (avail->flags & VRING_AVAIL_F_NO_INTERRUPT);
+    }
+    if (interrupt) {
+        v->interrupt_status |= VIRTIO_MMIO_INT_VRING;
+        set_external_irq(priv, EXT_IRQ_VBLK, true);
+    }
+}
+
+// Bytes of the config space, little endian like the host
+static uintptr_t config_read(struct vblk_state *v, uintptr_t offset, size_t len) {
+    const uint8_t *config = (const uint8_t *) &v->config;
+    uintptr_t value = 0;
+    for (size_t i = 0; i < len; i ++) {
+        if (offset + i < sizeof(v->config)) {
+            value |= (uintptr_t) config[offset + i] << (8 * i);
+        }
+    }
+    return value;
+}
+
+// Set half of a 64-bit register
+static void set_half(uint64_t *reg, bool high, uint32_t value) {
+    if (high) {
+        *reg = (*reg & 0xffffffffull) | ((uint64_t) value << 32);
+    } else {
+        *reg = (*reg & ~ 0xffffffffull) | value;
+    }
+}
+
+static uint32_t reg_read(struct vblk_state *v, uintptr_t offset) {
+    if (offset == VIRTIO_MMIO_MAGIC_VALUE) {
+        return 0x74726976;
+    } else if (offset == VIRTIO_MMIO_VERSION) {
+        return 2;
+    } else if (offset == VIRTIO_MMIO_DEVICE_ID) {
+        return VIRTIO_ID_BLOCK;
+    } else if (offset == VIRTIO_MMIO_VENDOR_ID) {
+        return VBLK_VENDOR_ID;
+    } else if (offset == VIRTIO_MMIO_DEVICE_FEATURES) {
+        return v->device_features_sel < 2 ? VBLK_FEATURES >> (32 * v->device_features_sel) : 0;
+    } else if (offset == VIRTIO_MMIO_QUEUE_NUM_MAX) {
+        return v->queue_sel == 0 ? URVIRT_VIRTIO_QUEUE_MAX : 0;
+    } else if (offset == VIRTIO_MMIO_QUEUE_READY) {
+        return v->queue_sel == 0 && v->queue_ready;
+    } else if (offset == VIRTIO_MMIO_INTERRUPT_STATUS) {
+        return v->interrupt_status;
+    } else if (offset == VIRTIO_MMIO_STATUS) {
+        return v->status;
+    } else {
+        // The config generation never changes, and the rest reads as 0
+        return 0;
+    }
+}
+
+static void reg_write(struct priv_state *priv, struct vblk_state *v, uintptr_t offset, uint32_t value) {
+    if (offset == VIRTIO_MMIO_DEVICE_FEATURES_SEL) {
+        v->device_features_sel = value;
+    } else if (offset == VIRTIO_MMIO_DRIVER_FEATURES_SEL) {
+        v->driver_features_sel = value;
+    } else if (offset == VIRTIO_MMIO_DRIVER_FEATURES) {
+        if (v->driver_features_sel < 2) {
+            set_half(&v->driver_features, v->driver_features_sel == 1, value);
+        }
+    } else if (offset == VIRTIO_MMIO_STATUS) {
+        if (value == 0) {
+            reset(priv, v);
+            return;
+        }
+        // Only the modern interface, and nothing that wasn't offered
+        if ((value & VIRTIO_CONFIG_S_FEATURES_OK)
+            && ((v->driver_features & ~ VBLK_FEATURES) != 0 || ! has_feature(v, VIRTIO_F_VERSION_1))) {
+            value &= ~ VIRTIO_CONFIG_S_FEATURES_OK;
+        }
+        v->status = value;
+    } else if (offset == VIRTIO_MMIO_INTERRUPT_ACK) {
+        v->interrupt_status &= ~ value;
+        set_external_irq(priv, EXT_IRQ_VBLK, v->interrupt_status != 0);
+    } else if (offset == VIRTIO_MMIO_QUEUE_NOTIFY) {
+        if (value == 0 && v->queue_ready && (v->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
+            notify(priv, v);
+        }
+    } else if (offset == VIRTIO_MMIO_QUEUE_SEL) {
+        v->queue_sel = value;
+    } else if (v->queue_sel != 0) {
+        // There's just the one queue
+    } else if (offset == VIRTIO_MMIO_QUEUE_NUM) {
+        v->queue_num = value;
+    } else if (offset == VIRTIO_MMIO_QUEUE_READY) {
+        if (value == 1) {
+            queue_ready(v);
+        } else {
+            v->queue_ready = false;
+        }
+    } else if (offset == VIRTIO_MMIO_QUEUE_DESC_LOW || offset == VIRTIO_MMIO_QUEUE_DESC_HIGH) {
+        set_half(&v->queue_desc, offset == VIRTIO_MMIO_QUEUE_DESC_HIGH, value);
+    } else if (offset == VIRTIO_MMIO_QUEUE_AVAIL_LOW || offset == VIRTIO_MMIO_QUEUE_AVAIL_HIGH) {
+        set_half(&v->queue_avail, offset == VIRTIO_MMIO_QUEUE_AVAIL_HIGH, value);
+    } else if (offset == VIRTIO_MMIO_QUEUE_USED_LOW || offset == VIRTIO_MMIO_QUEUE_USED_HIGH) {
+        set_half(&v->queue_used, offset == VIRTIO_MMIO_QUEUE_USED_HIGH, value);
+    }
+}
+
+bool vblk_access(struct priv_state *priv, uintptr_t pa, size_t len, bool write, uintptr_t *value) {
+    struct vblk_state *v = get_vblk();
+    uintptr_t offset = pa - URVIRT_VIRTIO_BLK;
+
+    if (offset >= VIRTIO_MMIO_CONFIG) {
+        // Nothing in it is writable
+        if (! write) {
+            *value = config_read(v, offset - VIRTIO_MMIO_CONFIG, len);
+        }
+    } else if (len != 4 || (offset & 3) != 0) {
+        printf("[urvirt] virtio-blk register 0x%zx accessed with %zd bytes\n", offset, len);
+        return false;
+    } else if (write) {
+        reg_write(priv, v, offset, *value);
+    } else {
+        *value = reg_read(v, offset);
+    }
+    return true;
+}
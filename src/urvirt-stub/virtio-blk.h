@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/uio.h>
+#include <linux/virtio_blk.h>
+
+#include "common.h"
+#include "urvirt-virtio.h"
+#include "riscv-priv.h"
+
+// The virtio-blk device
+//
+// The registers trap like any MMIO, but once the queue is set up only
+// VIRTIO_MMIO_QUEUE_NOTIFY and the interrupt registers are used. The queue
+// itself is in guest RAM and is read through the RAM window. A notification
+// takes everything on the avail ring at once, so a driver that puts many
+// requests there before notifying gets them all done in one SIGSEGV. Each
+// request is one preadv or pwritev between BLOCK_FD and the RAM window.
+//
+// With VIRTIO_RING_F_EVENT_IDX the device asks to be notified of the next
+// request, since it's done with everything before it, and only raises the
+// interrupt when the driver's used_event says so.
+
+struct vblk_state {
+    uint32_t status;
+    uint32_t device_features_sel;
+    uint32_t driver_features_sel;
+    uint64_t driver_features;
+    uint32_t queue_sel;
+    uint32_t interrupt_status;
+
+    // The one queue
+    uint32_t queue_num;
+    bool queue_ready;
+    uint64_t queue_desc;
+    uint64_t queue_avail;
+    uint64_t queue_used;
+    uint16_t last_avail;    // Next entry of the avail ring to take
+    uint16_t used_idx;      // Next entry of the used ring to put
+
+    struct virtio_blk_config config;
+
+    // Buffers of the request being done, header and status included
+    struct iovec iov[URVIRT_VIRTIO_SEG_MAX + 2];
+};
+
+void vblk_init(struct priv_state *priv);
+
+// Read or write len bytes of the device register at pa. Returns false if
+// there's none.
+bool vblk_access(struct priv_state *priv, uintptr_t pa, size_t len, bool write, uintptr_t *value);